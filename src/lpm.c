@@ -15,12 +15,23 @@
   #include <sys/ioctl.h>
   #include <libgen.h>
   #include <termios.h>
+  #ifdef __linux__
+    #include <sys/syscall.h>
+    #ifndef FICLONE
+      #define FICLONE _IOW(0x94, 9, int)
+    #endif
+    #ifndef RENAME_EXCHANGE
+      #define RENAME_EXCHANGE (1 << 1)
+    #endif
+  #endif
 
   #define MAX_PATH PATH_MAX
 #endif
 
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <math.h>
 #include <errno.h>
 #include <ctype.h>
 #include <dirent.h>
@@ -29,6 +40,33 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 
+// Hardware SHA256 kernels are compiled in whenever the compiler is capable of targeting them.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define LPM_SHA256_SHANI
+  #include <immintrin.h>
+  #include <cpuid.h>
+#endif
+// Older compilers only expose the crypto intrinsics when they're enabled for the whole translation unit.
+#if defined(__aarch64__) && (defined(__linux__) || defined(__APPLE__)) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO) || (!defined(__clang__) && __GNUC__ >= 9) || __clang_major__ >= 16)
+  #define LPM_SHA256_ARMV8
+  #include <arm_neon.h>
+  #ifdef __linux__
+    #include <sys/auxv.h>
+    #ifndef HWCAP_SHA2
+      #define HWCAP_SHA2 (1 << 6)
+    #endif
+  #endif
+#endif
+// The JSON decoder scans strings 16 bytes at a time wherever SSE2 or NEON are part of the baseline.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__SSE2__) || defined(__ARM_NEON))
+  #define LPM_JSON_SIMD
+  #ifdef __SSE2__
+    #include <emmintrin.h>
+  #else
+    #include <arm_neon.h>
+  #endif
+#endif
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -261,9 +299,20 @@ typedef struct {
 	unsigned char data[64];
 	int datalen;
 	unsigned long long bitlen;
-	int state[8];
+	unsigned int state[8];
 } SHA256_CTX;
 
+static const unsigned int sha256_k[64] = {
+  0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+  0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+  0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+  0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+  0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+  0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+  0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+  0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
 #define ROTLEFT(a,b) (((a) << (b)) | ((a) >> (32-(b))))
 #define ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
 #define CH(x,y,z) (((x) & (y)) ^ (~(x) & (z)))
@@ -272,57 +321,124 @@ typedef struct {
 #define EP1(x) (ROTRIGHT(x,6) ^ ROTRIGHT(x,11) ^ ROTRIGHT(x,25))
 #define SIG0(x) (ROTRIGHT(x,7) ^ ROTRIGHT(x,18) ^ ((x) >> 3))
 #define SIG1(x) (ROTRIGHT(x,17) ^ ROTRIGHT(x,19) ^ ((x) >> 10))
-static void sha256_transform(SHA256_CTX *ctx, const unsigned char* data) {
-  static const unsigned int k[64] = {
-    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
-    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
-    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
-    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
-    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
-    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
-    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
-    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
-  };
-
+static void sha256_transform_generic(unsigned int* state, const unsigned char* data, size_t blocks) {
 	unsigned int a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
 
-	for (i = 0, j = 0; i < 16; ++i, j += 4)
-		m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
-	for ( ; i < 64; ++i)
-		m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-	a = ctx->state[0];
-	b = ctx->state[1];
-	c = ctx->state[2];
-	d = ctx->state[3];
-	e = ctx->state[4];
-	f = ctx->state[5];
-	g = ctx->state[6];
-	h = ctx->state[7];
-
-	for (i = 0; i < 64; ++i) {
-		t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-		t2 = EP0(a) + MAJ(a,b,c);
-		h = g;
-		g = f;
-		f = e;
-		e = d + t1;
-		d = c;
-		c = b;
-		b = a;
-		a = t1 + t2;
-	}
+	for (; blocks > 0; --blocks, data += 64) {
+		for (i = 0, j = 0; i < 16; ++i, j += 4)
+			m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
+		for ( ; i < 64; ++i)
+			m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+
+		for (i = 0; i < 64; ++i) {
+			t1 = h + EP1(e) + CH(e,f,g) + sha256_k[i] + m[i];
+			t2 = EP0(a) + MAJ(a,b,c);
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
 
-	ctx->state[0] += a;
-	ctx->state[1] += b;
-	ctx->state[2] += c;
-	ctx->state[3] += d;
-	ctx->state[4] += e;
-	ctx->state[5] += f;
-	ctx->state[6] += g;
-	ctx->state[7] += h;
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+	}
 }
 
+// Hardware kernels are selected at runtime depending on what the CPU actually supports. In all cases, we keep the
+// generic implementation as a fallback.
+#ifdef LPM_SHA256_SHANI
+  __attribute__((target("sha,sse4.1,ssse3")))
+  static void sha256_transform_shani(unsigned int* state, const unsigned char* data, size_t blocks) {
+    const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+    for (; blocks > 0; --blocks, data += 64) {
+      __m128i abef = state0, cdgh = state1, m[4], wk;
+      for (int i = 0; i < 16; ++i) {
+        if (i < 4)
+          m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&data[i * 16]), byteswap);
+        else
+          m[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]), _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)), m[(i + 3) & 3]);
+        wk = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+      }
+      state0 = _mm_add_epi32(state0, abef);
+      state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+  }
+
+  static int sha256_has_shani() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+      return 0;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29));
+  }
+#endif
+#ifdef LPM_SHA256_ARMV8
+  #ifdef __clang__
+    __attribute__((target("crypto")))
+  #else
+    __attribute__((target("+crypto")))
+  #endif
+  static void sha256_transform_armv8(unsigned int* state, const unsigned char* data, size_t blocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]), state1 = vld1q_u32(&state[4]);
+    for (; blocks > 0; --blocks, data += 64) {
+      uint32x4_t abcd = state0, efgh = state1, m[4], wk, tmp;
+      for (int i = 0; i < 16; ++i) {
+        if (i < 4)
+          m[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&data[i * 16])));
+        else
+          m[i & 3] = vsha256su1q_u32(vsha256su0q_u32(m[i & 3], m[(i + 1) & 3]), m[(i + 2) & 3], m[(i + 3) & 3]);
+        wk = vaddq_u32(m[i & 3], vld1q_u32(&sha256_k[i * 4]));
+        tmp = state0;
+        state0 = vsha256hq_u32(state0, state1, wk);
+        state1 = vsha256h2q_u32(state1, tmp, wk);
+      }
+      state0 = vaddq_u32(state0, abcd);
+      state1 = vaddq_u32(state1, efgh);
+    }
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+  }
+
+  static int sha256_has_armv8() {
+    #ifdef __APPLE__
+      return 1; // Every Apple Silicon chip has these.
+    #else
+      return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+    #endif
+  }
+#endif
+
+static void (*sha256_transform)(unsigned int* state, const unsigned char* data, size_t blocks) = sha256_transform_generic;
+static const char* sha256_kernel = "generic";
+
 static void sha256_init(SHA256_CTX *ctx) {
 	ctx->datalen = 0;
 	ctx->bitlen = 0;
@@ -337,15 +453,27 @@ static void sha256_init(SHA256_CTX *ctx) {
 }
 
 static void sha256_update(SHA256_CTX *ctx, const unsigned char* data, size_t len) {
-	for (int i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	if (ctx->datalen > 0) {
+		size_t fill = 64 - ctx->datalen < len ? 64 - ctx->datalen : len;
+		memcpy(&ctx->data[ctx->datalen], data, fill);
+		ctx->datalen += fill;
+		data += fill;
+		len -= fill;
+		if (ctx->datalen < 64)
+			return;
+		sha256_transform(ctx->state, ctx->data, 1);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
+	// Feed whole blocks straight from the input, so the hardware kernels can churn through them without copying.
+	if (len >= 64) {
+		sha256_transform(ctx->state, data, len / 64);
+		ctx->bitlen += (unsigned long long)(len / 64) * 512;
+		data += len & ~(size_t)63;
+		len &= 63;
 	}
+	memcpy(ctx->data, data, len);
+	ctx->datalen = len;
 }
 
 static void sha256_final(SHA256_CTX *ctx, unsigned char* hash) {
@@ -361,7 +489,7 @@ static void sha256_final(SHA256_CTX *ctx, unsigned char* hash) {
 		ctx->data[i++] = 0x80;
 		while (i < 64)
 			ctx->data[i++] = 0x00;
-		sha256_transform(ctx, ctx->data);
+		sha256_transform(ctx->state, ctx->data, 1);
 		memset(ctx->data, 0, 56);
 	}
 
@@ -375,7 +503,7 @@ static void sha256_final(SHA256_CTX *ctx, unsigned char* hash) {
 	ctx->data[58] = ctx->bitlen >> 40;
 	ctx->data[57] = ctx->bitlen >> 48;
 	ctx->data[56] = ctx->bitlen >> 56;
-	sha256_transform(ctx, ctx->data);
+	sha256_transform(ctx->state, ctx->data, 1);
 
 	// Since this implementation uses little endian byte ordering and SHA uses big endian,
 	// reverse all the bytes when copying the final state to the output hash.
@@ -390,34 +518,753 @@ static void sha256_final(SHA256_CTX *ctx, unsigned char* hash) {
 		hash[i + 28] = (ctx->state[7] >> (24 - i * 8)) & 0x000000ff;
 	}
 }
+// Picks the fastest kernel the CPU supports, and checks it against the generic implementation, in case of broken
+// hardware or emulators that advertise instructions they don't correctly implement.
+static void sha256_setup() {
+  #ifdef LPM_SHA256_SHANI
+    if (sha256_has_shani()) {
+      sha256_transform = sha256_transform_shani;
+      sha256_kernel = "sha-ni";
+    }
+  #endif
+  #ifdef LPM_SHA256_ARMV8
+    if (sha256_has_armv8()) {
+      sha256_transform = sha256_transform_armv8;
+      sha256_kernel = "armv8-crypto";
+    }
+  #endif
+  if (sha256_transform != sha256_transform_generic) {
+    unsigned char data[64 * 3 + 7];
+    unsigned int expected[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    unsigned int actual[8];
+    for (size_t i = 0; i < sizeof(data); ++i)
+      data[i] = (unsigned char)(i * 7 + 1);
+    memcpy(actual, expected, sizeof(expected));
+    sha256_transform_generic(expected, &data[7], 3);
+    sha256_transform(actual, &data[7], 3);
+    if (memcmp(expected, actual, sizeof(expected)) != 0) {
+      sha256_transform = sha256_transform_generic;
+      sha256_kernel = "generic (hardware kernel failed self-test)";
+    }
+  }
+}
+
+/** Hash cache; remembers file digests by (device, inode, size, mtime), so that unchanged files aren't constantly rehashed. **/
+static const char hash_cache_magic[8] = "LPMHASH1";
+
+typedef struct {
+  unsigned long long dev;
+  unsigned long long ino;
+  unsigned long long size;
+  long long mtime; // In nanoseconds on posix, 100-nanosecond intervals on windows.
+  unsigned int used; // Last time this entry was hit, for eviction; 0 if this slot is empty.
+  unsigned char digest[32];
+} hash_cache_entry_t;
+
+static hash_cache_entry_t* hash_cache;
+static size_t hash_cache_capacity, hash_cache_count, hash_cache_max;
+static int hash_cache_dirty;
+#ifdef _WIN32
+  static wchar_t* hash_cache_path;
+#else
+  static char* hash_cache_path;
+#endif
+
+// Fills out the identifying fields of an entry. Returns -1 if we can't, and 1 if the file was modified too recently
+// to be trusted, as it could be modified again within the resolution of its mtime.
+static int hash_cache_identify(lua_State* L, const char* path, hash_cache_entry_t* entry) {
+  long long modified;
+  #ifdef _WIN32
+    HANDLE file = CreateFileW(lua_toutf16(L, path), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    lua_pop(L, 1);
+    if (file == INVALID_HANDLE_VALUE)
+      return -1;
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL success = GetFileInformationByHandle(file, &info);
+    CloseHandle(file);
+    if (!success)
+      return -1;
+    entry->dev = info.dwVolumeSerialNumber;
+    entry->ino = ((unsigned long long)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    entry->size = ((unsigned long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    entry->mtime = ((long long)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    modified = entry->mtime / 10000000 - 11644473600LL;
+  #else
+    struct stat s;
+    if (stat(path, &s))
+      return -1;
+    entry->dev = s.st_dev;
+    entry->ino = s.st_ino;
+    entry->size = s.st_size;
+    #ifdef __APPLE__
+      entry->mtime = (long long)s.st_mtimespec.tv_sec * 1000000000LL + s.st_mtimespec.tv_nsec;
+    #else
+      entry->mtime = (long long)s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+    #endif
+    modified = s.st_mtime;
+  #endif
+  return modified >= (long long)time(NULL) - 2 ? 1 : 0;
+}
+
+// Returns either the slot holding this file, or the empty slot where it should go.
+static hash_cache_entry_t* hash_cache_slot(const hash_cache_entry_t* key) {
+  size_t mask = hash_cache_capacity - 1;
+  size_t i = (size_t)((key->ino * 0x9E3779B97F4A7C15ULL) ^ (key->dev * 0xC2B2AE3D27D4EB4FULL) ^ (key->ino >> 29)) & mask;
+  while (hash_cache[i].used && (hash_cache[i].ino != key->ino || hash_cache[i].dev != key->dev))
+    i = (i + 1) & mask;
+  return &hash_cache[i];
+}
+
+static int hash_cache_compare_used(const void* a, const void* b) {
+  unsigned int used_a = ((const hash_cache_entry_t*)a)->used, used_b = ((const hash_cache_entry_t*)b)->used;
+  return used_a < used_b ? 1 : (used_a > used_b ? -1 : 0);
+}
+
+// Drops the least recently used quarter of entries.
+static void hash_cache_evict() {
+  hash_cache_entry_t* entries = malloc(sizeof(hash_cache_entry_t) * hash_cache_count);
+  if (!entries)
+    return;
+  size_t count = 0;
+  for (size_t i = 0; i < hash_cache_capacity; ++i) {
+    if (hash_cache[i].used)
+      entries[count++] = hash_cache[i];
+  }
+  qsort(entries, count, sizeof(hash_cache_entry_t), hash_cache_compare_used);
+  memset(hash_cache, 0, sizeof(hash_cache_entry_t) * hash_cache_capacity);
+  hash_cache_count = count < hash_cache_max * 3 / 4 ? count : hash_cache_max * 3 / 4;
+  for (size_t i = 0; i < hash_cache_count; ++i)
+    *hash_cache_slot(&entries[i]) = entries[i];
+  free(entries);
+  hash_cache_dirty = 1;
+}
+
+static void hash_cache_insert(const hash_cache_entry_t* entry) {
+  hash_cache_entry_t* slot = hash_cache_slot(entry);
+  if (!slot->used) {
+    if (hash_cache_count >= hash_cache_max) {
+      hash_cache_evict();
+      slot = hash_cache_slot(entry);
+    }
+    hash_cache_count++;
+  }
+  *slot = *entry;
+  hash_cache_dirty = 1;
+}
+
+// Written to a temporary file and renamed, so concurrent lpms never see a partially written cache.
+static void hash_cache_save() {
+  if (!hash_cache || !hash_cache_dirty)
+    return;
+  hash_cache_dirty = 0;
+  unsigned int entry_size = sizeof(hash_cache_entry_t);
+  #ifdef _WIN32
+    wchar_t temporary_path[MAX_PATH];
+    _snwprintf(temporary_path, MAX_PATH, L"%ls.%d", hash_cache_path, _getpid());
+    FILE* file = _wfopen(temporary_path, L"wb");
+  #else
+    char temporary_path[MAX_PATH];
+    snprintf(temporary_path, MAX_PATH, "%s.%d", hash_cache_path, (int)getpid());
+    FILE* file = fopen(temporary_path, "wb");
+  #endif
+  if (!file)
+    return;
+  int success = fwrite(hash_cache_magic, sizeof(hash_cache_magic), 1, file) == 1 && fwrite(&entry_size, sizeof(entry_size), 1, file) == 1;
+  for (size_t i = 0; success && i < hash_cache_capacity; ++i) {
+    if (hash_cache[i].used)
+      success = fwrite(&hash_cache[i], sizeof(hash_cache_entry_t), 1, file) == 1;
+  }
+  success = fclose(file) == 0 && success;
+  #ifdef _WIN32
+    if (!success || !MoveFileExW(temporary_path, hash_cache_path, MOVEFILE_REPLACE_EXISTING))
+      _wunlink(temporary_path);
+  #else
+    if (!success || rename(temporary_path, hash_cache_path))
+      unlink(temporary_path);
+  #endif
+}
+
+static int lpm_hash_cache(lua_State* L) {
+  const char* path = luaL_optstring(L, 1, NULL);
+  hash_cache_save();
+  free(hash_cache);
+  free(hash_cache_path);
+  hash_cache = NULL;
+  hash_cache_path = NULL;
+  hash_cache_count = 0;
+  if (!path)
+    return 0;
+  hash_cache_max = imax(luaL_optinteger(L, 2, 32768), 16);
+  for (hash_cache_capacity = 32; hash_cache_capacity < hash_cache_max * 2; hash_cache_capacity *= 2);
+  hash_cache = calloc(hash_cache_capacity, sizeof(hash_cache_entry_t));
+  #ifdef _WIN32
+    hash_cache_path = _wcsdup(lua_toutf16(L, path));
+  #else
+    hash_cache_path = strdup(path);
+  #endif
+  if (!hash_cache || !hash_cache_path)
+    return luaL_error(L, "can't allocate hash cache");
+  FILE* file = lua_fopen(L, path, "rb");
+  if (file) {
+    char magic[sizeof(hash_cache_magic)];
+    unsigned int entry_size;
+    if (fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, hash_cache_magic, sizeof(magic)) == 0 && fread(&entry_size, sizeof(entry_size), 1, file) == 1 && entry_size == sizeof(hash_cache_entry_t)) {
+      hash_cache_entry_t entry;
+      while (fread(&entry, sizeof(entry), 1, file) == 1) {
+        if (entry.used)
+          hash_cache_insert(&entry);
+      }
+    }
+    fclose(file);
+  }
+  hash_cache_dirty = 0;
+  static int registered;
+  if (!registered)
+    registered = !atexit(hash_cache_save);
+  return 0;
+}
+
+// Returns the cached entry for a file if it's still valid.
+static hash_cache_entry_t* hash_cache_lookup(const hash_cache_entry_t* key) {
+  hash_cache_entry_t* entry = hash_cache_slot(key);
+  if (!entry->used || entry->size != key->size || entry->mtime != key->mtime)
+    return NULL;
+  // Only bother rewriting the cache for recency once a day.
+  unsigned int now = time(NULL);
+  if (now - entry->used > 86400) {
+    entry->used = now;
+    hash_cache_dirty = 1;
+  }
+  return entry;
+}
+
+static void hash_cache_store(hash_cache_entry_t* key, const unsigned char* digest) {
+  key->used = time(NULL);
+  memcpy(key->digest, digest, sizeof(key->digest));
+  hash_cache_insert(key);
+}
+
+static int hash_file(FILE* file, unsigned char* digest, unsigned char* buffer, size_t buffer_size) {
+  SHA256_CTX hash_ctx;
+  sha256_init(&hash_ctx);
+  while (1) {
+    size_t bytes = fread(buffer, 1, buffer_size, file);
+    sha256_update(&hash_ctx, buffer, bytes);
+    if (bytes < buffer_size)
+      break;
+  }
+  if (ferror(file))
+    return -1;
+  sha256_final(&hash_ctx, digest);
+  return 0;
+}
+
+// Hashes a file, going through the hash cache if it's enabled. Returns -1 if the file can't be opened, and 1 if it can't be read.
+static int hash_path(lua_State* L, const char* path, unsigned char* digest) {
+  hash_cache_entry_t key = {0}, *entry;
+  int identity = hash_cache ? hash_cache_identify(L, path, &key) : -1;
+  if (identity != -1 && (entry = hash_cache_lookup(&key))) {
+    memcpy(digest, entry->digest, sizeof(entry->digest));
+    return 0;
+  }
+  FILE* file = lua_fopen(L, path, "rb");
+  if (!file)
+    return -1;
+  unsigned char chunk[65536];
+  int error = hash_file(file, digest, chunk, sizeof(chunk));
+  fclose(file);
+  if (error)
+    return 1;
+  if (identity == 0)
+    hash_cache_store(&key, digest);
+  return 0;
+}
+
 static int lpm_hash(lua_State* L) {
   size_t len;
   const char* data = luaL_checklstring(L, 1, &len);
   const char* type = luaL_optstring(L, 2, "string");
   static const int digest_length = 32;
   unsigned char buffer[digest_length];
-  SHA256_CTX hash_ctx;
-  sha256_init(&hash_ctx);
   if (strcmp(type, "file") == 0) {
-    FILE* file = lua_fopen(L, data, "rb");
-    if (!file)
-      return luaL_error(L, "can't open %s", data);
-    while (1) {
-      unsigned char chunk[4096];
-      size_t bytes = fread(chunk, 1, sizeof(chunk), file);
-      sha256_update(&hash_ctx, chunk, bytes);
-      if (bytes < sizeof(chunk))
-        break;
-    }
-    fclose(file);
+    int error = hash_path(L, data, buffer);
+    if (error)
+      return luaL_error(L, "can't %s %s", error < 0 ? "open" : "read", data);
   } else {
+    SHA256_CTX hash_ctx;
+    sha256_init(&hash_ctx);
     sha256_update(&hash_ctx, (unsigned char *) data, len);
+    sha256_final(&hash_ctx, buffer);
   }
-  sha256_final(&hash_ctx, buffer);
   lua_pushhexstring(L, buffer, digest_length);
   return 1;
 }
 
+static int lpm_hasher_update(lua_State* L) {
+  SHA256_CTX* hash_ctx = luaL_checkudata(L, 1, "lpm_hasher");
+  size_t len;
+  const char* data = luaL_checklstring(L, 2, &len);
+  sha256_update(hash_ctx, (const unsigned char*)data, len);
+  lua_settop(L, 1);
+  return 1;
+}
+
+// Hashes length bytes of a file starting at offset; or everything until the end of the file if no length is specified.
+static int lpm_hasher_update_file(lua_State* L) {
+  SHA256_CTX* hash_ctx = luaL_checkudata(L, 1, "lpm_hasher");
+  const char* path = luaL_checkstring(L, 2);
+  long long offset = luaL_optinteger(L, 3, 0);
+  long long remaining = luaL_optinteger(L, 4, -1);
+  FILE* file = lua_fopen(L, path, "rb");
+  if (!file)
+    return luaL_error(L, "can't open %s: %s", path, strerror(errno));
+  #ifdef _WIN32
+    int seek_error = offset > 0 && _fseeki64(file, offset, SEEK_SET);
+  #else
+    int seek_error = offset > 0 && fseeko(file, offset, SEEK_SET);
+  #endif
+  if (seek_error) {
+    fclose(file);
+    return luaL_error(L, "can't seek %s: %s", path, strerror(errno));
+  }
+  unsigned char chunk[65536];
+  while (remaining != 0) {
+    size_t bytes = fread(chunk, 1, remaining > 0 && remaining < sizeof(chunk) ? remaining : sizeof(chunk), file);
+    sha256_update(hash_ctx, chunk, bytes);
+    if (remaining > 0)
+      remaining -= bytes;
+    if (bytes == 0 || (remaining < 0 && bytes < sizeof(chunk)))
+      break;
+  }
+  int error = ferror(file);
+  fclose(file);
+  if (error)
+    return luaL_error(L, "can't read %s", path);
+  lua_settop(L, 1);
+  return 1;
+}
+
+// Doesn't disturb the hasher, so more can be fed in after taking a digest.
+static int lpm_hasher_digest(lua_State* L) {
+  SHA256_CTX hash_ctx = *(SHA256_CTX*)luaL_checkudata(L, 1, "lpm_hasher");
+  unsigned char buffer[32];
+  sha256_final(&hash_ctx, buffer);
+  lua_pushhexstring(L, buffer, sizeof(buffer));
+  return 1;
+}
+
+static int lpm_hasher(lua_State* L) {
+  static const luaL_Reg hasher_lib[] = {
+    { "update",      lpm_hasher_update },      // Feeds a string into the hash.
+    { "update_file", lpm_hasher_update_file }, // Feeds all or part of a file into the hash.
+    { "digest",      lpm_hasher_digest },      // Returns the hex sha256 hash of everything so far.
+    { NULL,          NULL }
+  };
+  sha256_init(lua_newuserdata(L, sizeof(SHA256_CTX)));
+  if (luaL_newmetatable(L, "lpm_hasher")) {
+    luaL_setfuncs(L, hasher_lib, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int cpu_count() {
+  #ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+  #else
+    return sysconf(_SC_NPROCESSORS_ONLN);
+  #endif
+}
+
+#define HASH_MANY_MAX_THREADS 16
+#define HASH_MANY_BUFFER_SIZE (256*1024)
+
+typedef struct {
+  #ifdef _WIN32
+    wchar_t* path;
+  #else
+    const char* path;
+  #endif
+  hash_cache_entry_t key;
+  int identity;
+  int status; // 0 if yet to be hashed, 1 if hashed, 2 if cached, -1 if the file couldn't be read.
+  unsigned char digest[32];
+} hash_job_t;
+
+typedef struct {
+  hash_job_t* jobs;
+  size_t count;
+  size_t next;
+  lpm_mutex_t* mutex;
+  int paired;    // If set, jobs are compared in pairs as they finish, and hashing stops at the first mismatch.
+  int different;
+} hash_pool_t;
+
+static void* hash_many_worker(void* data) {
+  hash_pool_t* pool = data;
+  unsigned char* buffer = malloc(HASH_MANY_BUFFER_SIZE);
+  while (1) {
+    lock_mutex(pool->mutex);
+    size_t i = pool->next++;
+    int different = pool->different;
+    unlock_mutex(pool->mutex);
+    if (i >= pool->count || different)
+      break;
+    hash_job_t* job = &pool->jobs[i];
+    if (job->status)
+      continue;
+    #ifdef _WIN32
+      FILE* file = _wfopen(job->path, L"rb");
+    #else
+      FILE* file = fopen(job->path, "rb");
+    #endif
+    int status = -1;
+    if (file) {
+      if (buffer && hash_file(file, job->digest, buffer, HASH_MANY_BUFFER_SIZE) == 0)
+        status = 1;
+      fclose(file);
+    }
+    lock_mutex(pool->mutex);
+    job->status = status;
+    if (pool->paired) {
+      hash_job_t* other = &pool->jobs[i ^ 1];
+      if (other->status && (status < 0 || other->status < 0 || memcmp(job->digest, other->digest, sizeof(job->digest))))
+        pool->different = 1;
+    }
+    unlock_mutex(pool->mutex);
+  }
+  free(buffer);
+  return NULL;
+}
+
+// Fills out a job from the hash cache if possible, and takes a copy of its path for the workers. Returns 1 if it still needs hashing.
+static int hash_job_init(lua_State* L, hash_job_t* job, const char* path) {
+  job->identity = hash_cache ? hash_cache_identify(L, path, &job->key) : -1;
+  hash_cache_entry_t* entry = job->identity != -1 ? hash_cache_lookup(&job->key) : NULL;
+  #ifdef _WIN32
+    job->path = _wcsdup(lua_toutf16(L, path));
+    lua_pop(L, 1);
+  #else
+    job->path = strdup(path);
+  #endif
+  if (entry) {
+    memcpy(job->digest, entry->digest, sizeof(job->digest));
+    job->status = 2;
+  } else
+    job->status = job->path ? 0 : -1;
+  return job->status == 0;
+}
+
+// Returns whether any pair differed, if paired.
+static int hash_jobs_run(hash_job_t* jobs, size_t count, size_t pending, int paired) {
+  if (pending == 0)
+    return 0;
+  hash_pool_t pool = { jobs, count, 0, new_mutex(), paired, 0 };
+  lpm_thread_t* threads[HASH_MANY_MAX_THREADS];
+  int thread_count = imax(imin(imin(cpu_count(), HASH_MANY_MAX_THREADS), pending), 1);
+  for (int i = 0; i < thread_count; ++i)
+    threads[i] = create_thread(hash_many_worker, &pool);
+  for (int i = 0; i < thread_count; ++i)
+    join_thread(threads[i]);
+  free_mutex(pool.mutex);
+  return pool.different;
+}
+
+// Caches anything freshly hashed, and frees the jobs.
+static void hash_jobs_free(hash_job_t* jobs, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (jobs[i].status == 1 && jobs[i].identity == 0)
+      hash_cache_store(&jobs[i].key, jobs[i].digest);
+    free((void*)jobs[i].path);
+  }
+  free(jobs);
+}
+
+static int lpm_hash_many(lua_State* L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  size_t count = lua_rawlen(L, 1), pending = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (lua_rawgeti(L, 1, i + 1) != LUA_TSTRING)
+      return luaL_error(L, "expected a path at index %d", (int)(i + 1));
+    lua_pop(L, 1);
+  }
+  hash_job_t* jobs = calloc(count ? count : 1, sizeof(hash_job_t));
+  if (!jobs)
+    return luaL_error(L, "can't allocate memory for %d hashes", (int)count);
+  // Cache lookups are done up front, so workers need no access to it.
+  for (size_t i = 0; i < count; ++i) {
+    lua_rawgeti(L, 1, i + 1);
+    pending += hash_job_init(L, &jobs[i], lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+  hash_jobs_run(jobs, count, pending, 0);
+  lua_createtable(L, count, 0);
+  for (size_t i = 0; i < count; ++i) {
+    if (jobs[i].status > 0)
+      lua_pushhexstring(L, jobs[i].digest, sizeof(jobs[i].digest));
+    else
+      lua_pushboolean(L, 0);
+    lua_rawseti(L, -2, i + 1);
+  }
+  hash_jobs_free(jobs, count);
+  return 1;
+}
+
+typedef struct {
+  char path1[MAX_PATH];
+  char path2[MAX_PATH];
+  int hidden;
+  hash_job_t* jobs; // Pairs of files with the same size, to be hashed once the walk is done.
+  size_t count;
+  size_t capacity;
+  size_t pending;
+  const char* difference;
+} tree_diff_t;
+
+static int tree_diff_found(tree_diff_t* diff, const char* path) {
+  diff->difference = path;
+  return 1;
+}
+
+// Returns the mode of a path, following symlinks, or 0 if it doesn't exist.
+static int tree_diff_stat(lua_State* L, const char* path, long long* size) {
+  #ifdef _WIN32
+    struct _stat s;
+    int err = _wstat(lua_toutf16(L, path), &s);
+    lua_pop(L, 1);
+  #else
+    struct stat s;
+    int err = stat(path, &s);
+  #endif
+  if (err)
+    return 0;
+  *size = s.st_size;
+  return s.st_mode;
+}
+
+static int tree_diff_push(lua_State* L, tree_diff_t* diff) {
+  if (diff->count + 2 > diff->capacity) {
+    size_t capacity = diff->capacity ? diff->capacity * 2 : 64;
+    hash_job_t* jobs = realloc(diff->jobs, capacity * sizeof(hash_job_t));
+    if (!jobs)
+      return tree_diff_found(diff, diff->path1);
+    diff->jobs = jobs;
+    diff->capacity = capacity;
+  }
+  hash_job_t* jobs = &diff->jobs[diff->count];
+  memset(jobs, 0, sizeof(hash_job_t) * 2);
+  diff->pending += hash_job_init(L, &jobs[0], diff->path1) + hash_job_init(L, &jobs[1], diff->path2);
+  diff->count += 2;
+  if (jobs[0].status < 0 || jobs[1].status < 0 || (jobs[0].status == 2 && jobs[1].status == 2 && memcmp(jobs[0].digest, jobs[1].digest, sizeof(jobs[0].digest))))
+    return tree_diff_found(diff, diff->path1);
+  return 0;
+}
+
+static int tree_diff_compare(lua_State* L, tree_diff_t* diff, size_t len1, size_t len2);
+
+// Compares an entry of the directories currently in path1 and path2; anything only in path2 is ignored.
+static int tree_diff_entry(lua_State* L, tree_diff_t* diff, size_t len1, size_t len2, const char* name) {
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (!diff->hidden && name[0] == '.'))
+    return 0;
+  size_t name_len = strlen(name);
+  if (len1 + name_len + 2 > MAX_PATH || len2 + name_len + 2 > MAX_PATH)
+    return tree_diff_found(diff, diff->path1);
+  #ifdef _WIN32
+    diff->path1[len1] = diff->path2[len2] = '\\';
+  #else
+    diff->path1[len1] = diff->path2[len2] = '/';
+  #endif
+  memcpy(&diff->path1[len1 + 1], name, name_len + 1);
+  memcpy(&diff->path2[len2 + 1], name, name_len + 1);
+  int different = tree_diff_compare(L, diff, len1 + name_len + 1, len2 + name_len + 1);
+  if (!different)
+    diff->path1[len1] = diff->path2[len2] = 0;
+  return different;
+}
+
+static int tree_diff_walk(lua_State* L, tree_diff_t* diff, size_t len1, size_t len2) {
+  int different = 0;
+  #ifdef _WIN32
+    if (len1 + 3 > MAX_PATH)
+      return tree_diff_found(diff, diff->path1);
+    memcpy(&diff->path1[len1], "\\*", 3);
+    WIN32_FIND_DATAW data;
+    HANDLE handle = FindFirstFileW(lua_toutf16(L, diff->path1), &data);
+    lua_pop(L, 1);
+    diff->path1[len1] = 0;
+    if (handle == INVALID_HANDLE_VALUE)
+      return tree_diff_found(diff, diff->path1);
+    do {
+      different = tree_diff_entry(L, diff, len1, len2, lua_toutf8(L, data.cFileName));
+      lua_pop(L, 1);
+    } while (!different && FindNextFileW(handle, &data));
+    FindClose(handle);
+  #else
+    DIR* dir = opendir(diff->path1);
+    if (!dir)
+      return tree_diff_found(diff, diff->path1);
+    struct dirent* entry;
+    while (!different && (entry = readdir(dir)))
+      different = tree_diff_entry(L, diff, len1, len2, entry->d_name);
+    closedir(dir);
+  #endif
+  return different;
+}
+
+// Short-circuits on anything that can be determined without reading files; files of the same size are queued for hashing.
+static int tree_diff_compare(lua_State* L, tree_diff_t* diff, size_t len1, size_t len2) {
+  long long size1, size2;
+  int mode1 = tree_diff_stat(L, diff->path1, &size1), mode2 = tree_diff_stat(L, diff->path2, &size2);
+  if (!mode1 || !mode2 || (mode1 & S_IFMT) != (mode2 & S_IFMT) || (!S_ISREG(mode1) && !S_ISDIR(mode1)) || (S_ISREG(mode1) && size1 != size2))
+    return tree_diff_found(diff, diff->path1);
+  if (S_ISDIR(mode1))
+    return tree_diff_walk(L, diff, len1, len2);
+  return tree_diff_push(L, diff);
+}
+
+// Returns whether path1 differs from path2, and if so, the first path under path1 found to be different.
+// If path1 is a directory, it's considered the same if it's a subset of path2 (accounting for binary downloads).
+static int lpm_tree_diff(lua_State* L) {
+  const char* path1 = luaL_checkstring(L, 1);
+  const char* path2 = luaL_checkstring(L, 2);
+  tree_diff_t* diff = calloc(1, sizeof(tree_diff_t));
+  if (!diff)
+    return luaL_error(L, "can't allocate memory to compare %s", path1);
+  if (lua_type(L, 3) == LUA_TTABLE) {
+    lua_getfield(L, 3, "hidden");
+    diff->hidden = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  size_t len1 = strlen(path1), len2 = strlen(path2);
+  int different = 1;
+  if (len1 < MAX_PATH && len2 < MAX_PATH) {
+    memcpy(diff->path1, path1, len1 + 1);
+    memcpy(diff->path2, path2, len2 + 1);
+    different = tree_diff_compare(L, diff, len1, len2);
+  } else
+    tree_diff_found(diff, path1);
+  if (!different && hash_jobs_run(diff->jobs, diff->count, diff->pending, 1)) {
+    for (size_t i = 0; i < diff->count && !different; i += 2) {
+      hash_job_t* jobs = &diff->jobs[i];
+      if (jobs[0].status && jobs[1].status && (jobs[0].status < 0 || jobs[1].status < 0 || memcmp(jobs[0].digest, jobs[1].digest, sizeof(jobs[0].digest)))) {
+        #ifdef _WIN32
+          different = tree_diff_found(diff, lua_toutf8(L, jobs[0].path));
+        #else
+          different = tree_diff_found(diff, jobs[0].path);
+        #endif
+      }
+    }
+  }
+  lua_pushboolean(L, different);
+  if (different)
+    lua_pushstring(L, diff->difference);
+  hash_jobs_free(diff->jobs, diff->count);
+  free(diff);
+  return different ? 2 : 1;
+}
+
+typedef struct {
+  char path[MAX_PATH];
+  SHA256_CTX hash;
+} tree_stamp_t;
+
+static void tree_stamp_add(tree_stamp_t* stamp, const char* name, unsigned long long dev, unsigned long long ino, unsigned long long size, long long mtime, unsigned int mode) {
+  struct { unsigned long long dev, ino, size; long long mtime; unsigned long long mode; } fields = { dev, ino, size, mtime, mode };
+  sha256_update(&stamp->hash, (const unsigned char*)name, strlen(name) + 1);
+  sha256_update(&stamp->hash, (const unsigned char*)&fields, sizeof(fields));
+}
+
+// Adds every entry under the directory currently in path, without following symlinks.
+static void tree_stamp_walk(lua_State* L, tree_stamp_t* stamp, size_t len) {
+  #ifdef _WIN32
+    if (len + 3 > MAX_PATH)
+      return;
+    memcpy(&stamp->path[len], "\\*", 3);
+    WIN32_FIND_DATAW data;
+    HANDLE handle = FindFirstFileW(lua_toutf16(L, stamp->path), &data);
+    lua_pop(L, 1);
+    stamp->path[len] = 0;
+    if (handle == INVALID_HANDLE_VALUE)
+      return;
+    do {
+      if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0)
+        continue;
+      const char* name = lua_toutf8(L, data.cFileName);
+      size_t name_len = strlen(name);
+      tree_stamp_add(stamp, name, 0, 0, ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow,
+        ((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime, data.dwFileAttributes);
+      if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && !(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && len + name_len + 2 < MAX_PATH) {
+        stamp->path[len] = '\\';
+        memcpy(&stamp->path[len + 1], name, name_len + 1);
+        tree_stamp_walk(L, stamp, len + name_len + 1);
+      }
+      lua_pop(L, 1);
+    } while (FindNextFileW(handle, &data));
+    FindClose(handle);
+  #else
+    DIR* dir = opendir(stamp->path);
+    if (!dir)
+      return;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+      struct stat s;
+      if (fstatat(dirfd(dir), entry->d_name, &s, AT_SYMLINK_NOFOLLOW)) {
+        tree_stamp_add(stamp, entry->d_name, 0, 0, 0, 0, 0);
+        continue;
+      }
+      #ifdef __APPLE__
+        long long mtime = (long long)s.st_mtimespec.tv_sec * 1000000000LL + s.st_mtimespec.tv_nsec;
+      #else
+        long long mtime = (long long)s.st_mtim.tv_sec * 1000000000LL + s.st_mtim.tv_nsec;
+      #endif
+      tree_stamp_add(stamp, entry->d_name, s.st_dev, s.st_ino, s.st_size, mtime, s.st_mode);
+      size_t name_len = strlen(entry->d_name);
+      if (S_ISDIR(s.st_mode) && len + name_len + 2 < MAX_PATH) {
+        stamp->path[len] = '/';
+        memcpy(&stamp->path[len + 1], entry->d_name, name_len + 1);
+        tree_stamp_walk(L, stamp, len + name_len + 1);
+      }
+    }
+    closedir(dir);
+  #endif
+  stamp->path[len] = 0;
+}
+
+// Returns a hex hash of the name, size, modification time and identity of everything under a directory, or nil if
+// there's nothing there. Cheap compared to hashing contents, and changes whenever anything underneath is touched.
+static int lpm_tree_stamp(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  size_t len = strlen(path);
+  #ifdef _WIN32
+    int exists = GetFileAttributesW(lua_toutf16(L, path)) != INVALID_FILE_ATTRIBUTES;
+    lua_pop(L, 1);
+  #else
+    struct stat s;
+    int exists = lstat(path, &s) == 0;
+  #endif
+  if (len >= MAX_PATH || !exists) {
+    lua_pushnil(L);
+    return 1;
+  }
+  tree_stamp_t* stamp = malloc(sizeof(tree_stamp_t));
+  if (!stamp)
+    return luaL_error(L, "can't allocate memory to stamp %s", path);
+  memcpy(stamp->path, path, len + 1);
+  sha256_init(&stamp->hash);
+  tree_stamp_walk(L, stamp, len);
+  unsigned char digest[32];
+  sha256_final(&stamp->hash, digest);
+  free(stamp);
+  lua_pushhexstring(L, digest, sizeof(digest));
+  return 1;
+}
+
 static int lpm_tcflush(lua_State* L) {
   int stream = luaL_checkinteger(L, 1);
   #ifndef _WIN32
@@ -471,8 +1318,13 @@ static int lpm_chmod(lua_State* L) {
   return 0;
 }
 
+// With "type", also returns an array of each entry's type; "file", "dir", or false for anything else, following
+// symlinks. With "stat", additionally returns arrays of sizes and modification times.
 static int lpm_ls(lua_State *L) {
   const char *path = luaL_checkstring(L, 1);
+  const char *details = luaL_optstring(L, 2, NULL);
+  int with_types = details && (strcmp(details, "type") == 0 || strcmp(details, "stat") == 0);
+  int with_stat = details && strcmp(details, "stat") == 0;
   int i = 1;
 #ifdef _WIN32
   lua_settop(L, 1);
@@ -484,12 +1336,30 @@ static int lpm_ls(lua_State *L) {
   HANDLE find_handle = FindFirstFileExW(lua_toutf16(L, path), FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, 0);
   if (find_handle == INVALID_HANDLE_VALUE)
     return luaL_win32_error(L, GetLastError(), "can't ls %s", path);
+  int names = lua_gettop(L) + 1;
   lua_newtable(L);
+  if (with_types)
+    lua_newtable(L);
+  if (with_stat) {
+    lua_newtable(L);
+    lua_newtable(L);
+  }
 
   do {
     const char* filename = lua_toutf8(L, fd.cFileName);
     if (strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0) {
-      lua_rawseti(L, -2, i++);
+      lua_rawseti(L, names, i);
+      if (with_types) {
+        lua_pushstring(L, fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? "dir" : "file");
+        lua_rawseti(L, names + 1, i);
+      }
+      if (with_stat) {
+        lua_pushinteger(L, ((long long)fd.nFileSizeHigh << 32) | fd.nFileSizeLow);
+        lua_rawseti(L, names + 2, i);
+        lua_pushinteger(L, ((((long long)fd.ftLastWriteTime.dwHighDateTime << 32) | fd.ftLastWriteTime.dwLowDateTime) / 10000000) - 11644473600LL);
+        lua_rawseti(L, names + 3, i);
+      }
+      ++i;
     } else
       lua_pop(L, 1);
   } while (FindNextFileW(find_handle, &fd));
@@ -501,21 +1371,202 @@ static int lpm_ls(lua_State *L) {
   DIR *dir = opendir(path);
   if (!dir)
     return luaL_error(L, "can't ls %s: %s", path, strerror(errno));
+  int names = lua_gettop(L) + 1;
   lua_newtable(L);
+  if (with_types)
+    lua_newtable(L);
+  if (with_stat) {
+    lua_newtable(L);
+    lua_newtable(L);
+  }
   struct dirent *entry;
   while ( (entry = readdir(dir)) ) {
     if (strcmp(entry->d_name, "." ) == 0) { continue; }
     if (strcmp(entry->d_name, "..") == 0) { continue; }
     lua_pushstring(L, entry->d_name);
-    lua_rawseti(L, -2, i++);
+    lua_rawseti(L, names, i);
+    if (with_types) {
+      // Only stat when we have to; symlinks need to be resolved, and some filesystems don't fill out d_type.
+      struct stat s;
+      int type = entry->d_type;
+      if (with_stat || type == DT_LNK || type == DT_UNKNOWN) {
+        if (fstatat(dirfd(dir), entry->d_name, &s, 0) == 0)
+          type = S_ISDIR(s.st_mode) ? DT_DIR : (S_ISREG(s.st_mode) ? DT_REG : DT_UNKNOWN);
+        else
+          type = DT_UNKNOWN;
+      }
+      if (type == DT_DIR || type == DT_REG)
+        lua_pushstring(L, type == DT_DIR ? "dir" : "file");
+      else
+        lua_pushboolean(L, 0);
+      lua_rawseti(L, names + 1, i);
+      if (with_stat) {
+        if (type != DT_UNKNOWN) {
+          lua_pushinteger(L, s.st_size);
+          lua_rawseti(L, names + 2, i);
+          lua_pushinteger(L, s.st_mtime);
+        } else {
+          lua_pushboolean(L, 0);
+          lua_rawseti(L, names + 2, i);
+          lua_pushboolean(L, 0);
+        }
+        lua_rawseti(L, names + 3, i);
+      }
+    }
+    ++i;
   }
   closedir(dir);
 #endif
+  return 1 + (with_types ? 1 : 0) + (with_stat ? 2 : 0);
+}
+// Directories mkdirp has already made or found in this process, so that repeated calls cost no syscalls.
+// Forgotten wholesale whenever anything is removed, renamed, or the working directory changes.
+#define MKDIRP_CACHE_SIZE 4096
+static char* mkdirp_cache[MKDIRP_CACHE_SIZE];
+static int mkdirp_cache_count;
+
+static void mkdirp_forget() {
+  for (int i = 0; i < MKDIRP_CACHE_SIZE; ++i) {
+    free(mkdirp_cache[i]);
+    mkdirp_cache[i] = NULL;
+  }
+  mkdirp_cache_count = 0;
+}
+
+static char** mkdirp_cache_slot(const char* path, size_t len) {
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i)
+    hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+  char** slot = &mkdirp_cache[hash % MKDIRP_CACHE_SIZE];
+  while (*slot && (strlen(*slot) != len || memcmp(*slot, path, len) != 0))
+    slot = slot == &mkdirp_cache[MKDIRP_CACHE_SIZE - 1] ? &mkdirp_cache[0] : slot + 1;
+  return slot;
+}
+
+static void mkdirp_remember(const char* path, size_t len) {
+  if (mkdirp_cache_count >= MKDIRP_CACHE_SIZE / 2)
+    mkdirp_forget();
+  char** slot = mkdirp_cache_slot(path, len);
+  if (!*slot && (*slot = malloc(len + 1))) {
+    memcpy(*slot, path, len);
+    (*slot)[len] = 0;
+    ++mkdirp_cache_count;
+  }
+}
+
+static int is_path_separator(char c) {
+  #ifdef _WIN32
+    return c == '/' || c == '\\';
+  #else
+    return c == '/';
+  #endif
+}
+
+// Returns 0, or the errno of the mkdir; an existing directory counts as success.
+static int mkdirp_make_directory(lua_State* L, const char* path) {
+  #ifdef _WIN32
+    LPCWSTR wpath = lua_toutf16(L, path);
+    int error = _wmkdir(wpath) ? errno : 0;
+    if (error == EEXIST || error == EACCES) {
+      DWORD attributes = GetFileAttributesW(wpath);
+      if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY))
+        error = 0;
+    }
+    lua_pop(L, 1);
+  #else
+    int error = mkdir(path, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) ? errno : 0;
+    struct stat s;
+    if (error == EEXIST)
+      error = stat(path, &s) == 0 && S_ISDIR(s.st_mode) ? 0 : EEXIST;
+  #endif
+  return error;
+}
+
+// Tries the leaf first, and only walks back towards the root while parents are missing; so making a directory in
+// an existing one costs a single mkdir. Modifies path in place, but restores it. Returns -1 and sets errno on failure.
+static int mkdirp_make(lua_State* L, char* path, size_t len) {
+  if (*mkdirp_cache_slot(path, len))
+    return 0;
+  int error = mkdirp_make_directory(L, path);
+  if (error == ENOENT) {
+    size_t parent = len;
+    while (parent > 0 && !is_path_separator(path[parent - 1]))
+      --parent;
+    while (parent > 1 && is_path_separator(path[parent - 1]))
+      --parent;
+    int is_root = parent <= 1 || (parent == 2 && path[1] == ':');
+    if (!is_root) {
+      char separator = path[parent];
+      path[parent] = 0;
+      int result = mkdirp_make(L, path, parent);
+      path[parent] = separator;
+      if (result)
+        return -1;
+      error = mkdirp_make_directory(L, path);
+    }
+  }
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  mkdirp_remember(path, len);
+  return 0;
+}
+
+static int lpm_mkdirp(lua_State* L) {
+  size_t len;
+  const char* path = luaL_checklstring(L, 1, &len);
+  char target[MAX_PATH];
+  while (len > 1 && is_path_separator(path[len - 1]))
+    --len;
+  if (len >= sizeof(target))
+    return luaL_error(L, "can't mkdirp %s: %s", path, strerror(ENAMETOOLONG));
+  memcpy(target, path, len);
+  target[len] = 0;
+  if (len > 0 && mkdirp_make(L, target, len))
+    return luaL_error(L, "can't mkdirp %s: %s", path, strerror(errno));
+  return 0;
+}
+
+// Like os.rename, but also takes UTF-8 paths on Windows. If exchange is specified, atomically swaps src and dst instead,
+// where the platform supports it.
+static int lpm_rename(lua_State* L) {
+  const char* src = luaL_checkstring(L, 1);
+  const char* dst = luaL_checkstring(L, 2);
+  int exchange = lua_toboolean(L, 3);
+  mkdirp_forget();
+  #ifdef _WIN32
+    if (exchange || !MoveFileExW(lua_toutf16(L, src), lua_toutf16(L, dst), 0)) {
+      lua_pushnil(L);
+      luaL_win32_push_error(L, exchange ? ERROR_NOT_SUPPORTED : GetLastError());
+      return 2;
+    }
+  #else
+    int error;
+    if (!exchange)
+      error = rename(src, dst) ? errno : 0;
+    else {
+      #if defined(__linux__) && defined(SYS_renameat2)
+        error = syscall(SYS_renameat2, AT_FDCWD, src, AT_FDCWD, dst, RENAME_EXCHANGE) ? errno : 0;
+      #elif defined(__APPLE__) && defined(RENAME_SWAP)
+        error = renamex_np(src, dst, RENAME_SWAP) ? errno : 0;
+      #else
+        error = ENOSYS;
+      #endif
+    }
+    if (error) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", src, strerror(error));
+      return 2;
+    }
+  #endif
+  lua_pushboolean(L, 1);
   return 1;
 }
 
 static int lpm_rmdir(lua_State *L) {
   const char *path = luaL_checkstring(L, 1);
+  mkdirp_forget();
 #ifdef _WIN32
   if (!RemoveDirectoryW(lua_toutf16(L, path)))
     return luaL_win32_error(L, GetLastError(), "can't rmdir %s", path);
@@ -538,20 +1589,102 @@ static int lpm_mkdir(lua_State *L) {
   return 0;
 }
 
-static int lpm_stat(lua_State *L) {
+// Returns whether anything, including a dangling symlink, exists at path.
+static int lpm_exists(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+#ifdef _WIN32
+  lua_pushboolean(L, GetFileAttributesW(lua_toutf16(L, path)) != INVALID_FILE_ATTRIBUTES);
+#else
+  struct stat s;
+  lua_pushboolean(L, lstat(path, &s) == 0);
+#endif
+  return 1;
+}
+
+static const char* stat_type(int mode) {
+  return S_ISREG(mode) ? "file" : (S_ISDIR(mode) ? "dir" : NULL);
+}
+
+// Returns "file" or "dir", following symlinks; false for anything else, and nil if nothing's there.
+static int lpm_type(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+#ifdef _WIN32
+  struct _stat s;
+  int err = _wstat(lua_toutf16(L, path), &s);
+#else
+  struct stat s;
+  int err = stat(path, &s);
+#endif
+  if (err)
+    lua_pushnil(L);
+  else if (stat_type(s.st_mode))
+    lua_pushstring(L, stat_type(s.st_mode));
+  else
+    lua_pushboolean(L, 0);
+  return 1;
+}
+
+#ifdef _WIN32
+  // _wstat always reports a single link.
+  static int stat_links(lua_State* L, const char* path, struct _stat* s) {
+    HANDLE file = CreateFileW(lua_toutf16(L, path), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    lua_pop(L, 1);
+    BY_HANDLE_FILE_INFORMATION info;
+    int links = file != INVALID_HANDLE_VALUE && GetFileInformationByHandle(file, &info) ? info.nNumberOfLinks : s->st_nlink;
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+    return links;
+  }
+#else
+  static int stat_links(lua_State* L, const char* path, struct stat* s) {
+    return s->st_nlink;
+  }
+#endif
+
+// Returns just the requested fields of a path as scalars, following symlinks.
+static int lpm_stat_fields(lua_State *L, const char* path) {
+  static const char* fields[] = { "type", "size", "modified", "mode", "links", "device", NULL };
+  int top = lua_gettop(L);
+#ifdef _WIN32
+  struct _stat s;
+  int err = _wstat(lua_toutf16(L, path), &s);
+#else
+  struct stat s;
+  int err = stat(path, &s);
+#endif
+  if (err) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  for (int i = 2; i <= top; ++i) {
+    switch (luaL_checkoption(L, i, NULL, fields)) {
+      case 0: if (stat_type(s.st_mode)) lua_pushstring(L, stat_type(s.st_mode)); else lua_pushnil(L); break;
+      case 1: lua_pushinteger(L, s.st_size); break;
+      case 2: lua_pushinteger(L, s.st_mtime); break;
+      case 3: lua_pushinteger(L, s.st_mode); break;
+      case 4: lua_pushinteger(L, stat_links(L, path, &s)); break;
+      case 5: lua_pushinteger(L, s.st_dev); break;
+    }
+  }
+  return top - 1;
+}
+
+// If fast is specified, skips canonicalizing the path, and abs_path is not returned.
+static int stat_path(lua_State *L, int fast) {
   const char *path = luaL_checkstring(L, 1);
 #ifdef _WIN32
   wchar_t full_path[MAX_PATH];
   struct _stat s;
   LPCWSTR wpath = lua_toutf16(L, path);
   int err = _wstat(wpath, &s);
-  const char *abs_path = !err && _wfullpath(full_path, wpath, MAX_PATH) ? lua_toutf8(L, (LPCWSTR)full_path) : NULL;
+  const char *abs_path = !err && !fast && _wfullpath(full_path, wpath, MAX_PATH) ? lua_toutf8(L, (LPCWSTR)full_path) : NULL;
 #else
   char full_path[MAX_PATH];
   struct stat s;
   int err = lstat(path, &s);
   const char *abs_path = NULL;
-  if (!err) {
+  if (!err && !fast) {
     if (S_ISLNK(s.st_mode)) {
       char folder_path[MAX_PATH];
       strcpy(folder_path, path);
@@ -565,13 +1698,15 @@ static int lpm_stat(lua_State *L) {
       abs_path = realpath(path, full_path);
   }
 #endif
-  if (err || !abs_path) {
+  if (err || (!fast && !abs_path)) {
     lua_pushnil(L);
     lua_pushstring(L, strerror(errno));
     return 2;
   }
   lua_newtable(L);
-  lua_pushstring(L, abs_path); lua_setfield(L, -2, "abs_path");
+  if (abs_path) {
+    lua_pushstring(L, abs_path); lua_setfield(L, -2, "abs_path");
+  }
   lua_pushvalue(L, 1); lua_setfield(L, -2, "path");
 
 #if _WIN32
@@ -625,10 +1760,22 @@ static int lpm_stat(lua_State *L) {
   lua_setfield(L, -2, "type");
   return 1;
 }
+
+// With field names after the path, returns only those fields.
+static int lpm_stat(lua_State *L) {
+  if (lua_type(L, 2) == LUA_TSTRING)
+    return lpm_stat_fields(L, luaL_checkstring(L, 1));
+  return stat_path(L, 0);
+}
+static int lpm_stat_fast(lua_State *L) { return stat_path(L, 1); }
 /** END STOLEN LITE CODE **/
 static int print_trace;
 static int lpm_trace(lua_State* L) {
   print_trace = lua_toboolean(L, 1) ? 1 : 0;
+  if (print_trace) {
+    fprintf(stderr, "[sha256] Using %s kernel.\n", sha256_kernel);
+    fflush(stderr);
+  }
   return 0;
 }
 
@@ -863,76 +2010,692 @@ static int lpm_trace(lua_State* L) {
         lua_pcall(L, 1, 0, 0);
         luaL_unref(L, LUA_REGISTRYINDEX, context->callback_function);
       }
-      luaL_unref(L, LUA_REGISTRYINDEX, (int)ctx);
-      if (context->error_code) {
-        return lua_error(L);
+      luaL_unref(L, LUA_REGISTRYINDEX, (int)ctx);
+      if (context->error_code) {
+        return lua_error(L);
+      }
+      return 1;
+    }
+    return lua_yieldk(L, 0, (lua_KContext)ctx, lpm_fetchk);
+  }
+
+
+  static int lpm_fetch(lua_State* L) {
+    git_init();
+    int args = lua_gettop(L);
+    fetch_context_t* context = lua_newuserdata(L, sizeof(fetch_context_t));
+    memset(context, 0, sizeof(fetch_context_t));
+    context->repository = luaL_checkgitrepo(L, 1);
+    const char* refspec = args >= 3 ? luaL_optstring(L, 3, NULL) : NULL;
+    context->depth = args >= 4 && !lua_isnil(L, 4) && !lua_toboolean(L, 4) ? 1 : GIT_FETCH_DEPTH_FULL;
+    if (args >= 5 && lua_isstring(L, 5)) {
+      git_proxy_options_init(&context->proxy_options, GIT_PROXY_OPTIONS_VERSION);
+      strncpy(context->proxy_url, lua_tostring(L, 5), sizeof(context->proxy_url));
+      context->proxy_options.type = GIT_PROXY_SPECIFIED;
+      context->proxy_options.credentials = NULL;
+      context->proxy_options.certificate_check = NULL;
+      context->proxy_options.url = context->proxy_url;
+    } else {
+      git_proxy_options_init(&context->proxy_options, GIT_PROXY_OPTIONS_VERSION);
+      context->proxy_options.type = GIT_PROXY_NONE;
+    }
+    context->L = L;
+    context->threaded = !lua_is_main_thread(L);
+    if (refspec)
+      strncpy(context->refspec, refspec, sizeof(context->refspec));
+    if (lua_type(L, 2) == LUA_TFUNCTION) {
+      lua_pushvalue(L, 2);
+      context->callback_function = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    int ctx = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (lua_is_main_thread(L)) {
+      lpm_fetch_thread(context);
+      return lpm_fetchk(L, 0, ctx);
+    } else {
+      context->thread = create_thread(lpm_fetch_thread, context);
+      return lua_yieldk(L, 0, (lua_KContext)ctx, lpm_fetchk);
+    }
+  }
+#else
+  static int lpm_init(lua_State* L) { return luaL_error(L, "this binary was compiled without git support"); }
+  static int lpm_fetch(lua_State* L) { return luaL_error(L, "this binary was compiled without git support"); }
+  static int lpm_reset(lua_State* L) { return luaL_error(L, "this binary was compiled without git support"); }
+#endif
+
+// Makes every parent directory of the file at path.
+static int mkdirp(lua_State* L, char* path, int len) {
+  int parent = len;
+  while (parent > 0 && path[parent - 1] != '/')
+    --parent;
+  if (--parent <= 0)
+    return 0;
+  path[parent] = 0;
+  int result = mkdirp_make(L, path, parent);
+  path[parent] = '/';
+  return result;
+}
+
+#ifdef _WIN32
+  #define WIDE_MAX_PATH 32768
+  // Replaces, rather than writes through, a destination that's hardlinked elsewhere, like into the addon store.
+  static BOOL copy_file_unlinked(LPCWSTR src, LPCWSTR dst) {
+    HANDLE file = CreateFileW(dst, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file != INVALID_HANDLE_VALUE) {
+      BY_HANDLE_FILE_INFORMATION info;
+      BOOL linked = GetFileInformationByHandle(file, &info) && info.nNumberOfLinks > 1;
+      CloseHandle(file);
+      if (linked)
+        DeleteFileW(dst);
+    }
+    return CopyFileW(src, dst, FALSE);
+  }
+
+  // Both paths are appended to in place as we descend, and left pointing at the offending entry on error.
+  static int copy_tree_recursive(wchar_t* src, size_t src_len, wchar_t* dst, size_t dst_len, int hidden) {
+    WIN32_FIND_DATAW fd;
+    wcscpy(&src[src_len], L"\\*");
+    HANDLE find = FindFirstFileExW(src, FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, 0);
+    src[src_len] = 0;
+    if (find == INVALID_HANDLE_VALUE)
+      return -1;
+    int result = 0;
+    do {
+      if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0 || (!hidden && fd.cFileName[0] == L'.'))
+        continue;
+      size_t name_len = wcslen(fd.cFileName);
+      if (src_len + name_len + 2 > WIDE_MAX_PATH || dst_len + name_len + 2 > WIDE_MAX_PATH) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        result = -1;
+        break;
+      }
+      src[src_len] = L'\\';
+      wcscpy(&src[src_len + 1], fd.cFileName);
+      dst[dst_len] = L'\\';
+      wcscpy(&dst[dst_len + 1], fd.cFileName);
+      if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+        if (!CreateDirectoryW(dst, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+          result = -1;
+        else
+          result = copy_tree_recursive(src, src_len + 1 + name_len, dst, dst_len + 1 + name_len, hidden);
+      } else if (!copy_file_unlinked(src, dst))
+        result = -1;
+      if (result)
+        break;
+      src[src_len] = 0;
+      dst[dst_len] = 0;
+    } while (FindNextFileW(find, &fd));
+    DWORD error = GetLastError();
+    FindClose(find);
+    SetLastError(error);
+    return result;
+  }
+#else
+  static int copy_file_contents(int in, int out, off_t size) {
+    #ifdef __linux__
+      // Reflink if the filesystem supports it; otherwise have the kernel copy, falling back to doing it ourselves.
+      if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+      #ifdef SYS_copy_file_range
+        off_t copied = 0;
+        while (copied < size) {
+          ssize_t length = syscall(SYS_copy_file_range, in, NULL, out, NULL, (size_t)(size - copied), 0);
+          if (length <= 0)
+            break;
+          copied += length;
+        }
+        if (copied >= size)
+          return 0;
+      #endif
+    #endif
+    char buffer[65536];
+    ssize_t length;
+    while ((length = read(in, buffer, sizeof(buffer))) != 0) {
+      if (length < 0) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      for (ssize_t written = 0, result; written < length; written += result) {
+        if ((result = write(out, &buffer[written], length - written)) < 0) {
+          if (errno != EINTR)
+            return -1;
+          result = 0;
+        }
+      }
+    }
+    return 0;
+  }
+
+  static int copy_file_at(int src_dir, const char* src_name, int dst_dir, const char* dst_name, const struct stat* s) {
+    int in = openat(src_dir, src_name, O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+      return -1;
+    // Replace, rather than truncate, a destination that's hardlinked elsewhere, like into the addon store.
+    struct stat d;
+    if (fstatat(dst_dir, dst_name, &d, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(d.st_mode) && d.st_nlink > 1)
+      unlinkat(dst_dir, dst_name, 0);
+    int out = openat(dst_dir, dst_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    int result = out != -1 && copy_file_contents(in, out, s->st_size) == 0 && fchmod(out, s->st_mode & 07777) == 0 ? 0 : -1;
+    int error = errno;
+    close(in);
+    if (out != -1 && close(out) && result == 0)
+      return -1;
+    errno = error;
+    return result;
+  }
+
+  typedef struct {
+    char path[MAX_PATH]; // The source path currently being copied, for error messages.
+    int hidden;
+  } copy_tree_t;
+
+  static int copy_tree_at(copy_tree_t* context, size_t path_len, int src_dir, int dst_dir) {
+    int fd = dup(src_dir);
+    DIR* dir = fd != -1 ? fdopendir(fd) : NULL;
+    if (!dir) {
+      if (fd != -1)
+        close(fd);
+      return -1;
+    }
+    int result = 0;
+    struct dirent* entry;
+    while (result == 0) {
+      errno = 0;
+      if (!(entry = readdir(dir))) {
+        result = errno ? -1 : 0;
+        break;
+      }
+      const char* name = entry->d_name;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (!context->hidden && name[0] == '.'))
+        continue;
+      size_t name_len = strlen(name);
+      if (path_len + name_len + 2 > sizeof(context->path)) {
+        errno = ENAMETOOLONG;
+        result = -1;
+        break;
+      }
+      context->path[path_len] = '/';
+      memcpy(&context->path[path_len + 1], name, name_len + 1);
+      // Follows symlinks, like everything else in lpm that copies.
+      struct stat s;
+      if (fstatat(src_dir, name, &s, 0)) {
+        result = -1;
+      } else if (S_ISDIR(s.st_mode)) {
+        int src_subdir = -1, dst_subdir = -1;
+        if ((mkdirat(dst_dir, name, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) && errno != EEXIST) ||
+          (src_subdir = openat(src_dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+          (dst_subdir = openat(dst_dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+          copy_tree_at(context, path_len + 1 + name_len, src_subdir, dst_subdir))
+          result = -1;
+        int error = errno;
+        if (src_subdir != -1)
+          close(src_subdir);
+        if (dst_subdir != -1)
+          close(dst_subdir);
+        errno = error;
+      } else {
+        result = copy_file_at(src_dir, name, dst_dir, name, &s);
+      }
+      if (result == 0)
+        context->path[path_len] = 0;
+    }
+    int error = errno;
+    closedir(dir);
+    errno = error;
+    return result;
+  }
+#endif
+
+// Copies a file, or recursively copies a directory into dst, which is created if it doesn't exist. File modes are
+// preserved. Hidden files are skipped, unless { hidden = true } is specified.
+static int lpm_copy_tree(lua_State* L) {
+  const char* src = luaL_checkstring(L, 1);
+  const char* dst = luaL_checkstring(L, 2);
+  int hidden = 0;
+  if (lua_type(L, 3) == LUA_TTABLE) {
+    lua_getfield(L, 3, "hidden");
+    hidden = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  #ifdef _WIN32
+    wchar_t* src_path = malloc(sizeof(wchar_t) * WIDE_MAX_PATH * 2);
+    if (!src_path)
+      return luaL_error(L, "can't allocate memory to copy %s", src);
+    wchar_t* dst_path = &src_path[WIDE_MAX_PATH];
+    LPCWSTR wsrc = lua_toutf16(L, src), wdst = lua_toutf16(L, dst);
+    if (wcslen(wsrc) >= WIDE_MAX_PATH || wcslen(wdst) >= WIDE_MAX_PATH) {
+      free(src_path);
+      return luaL_error(L, "can't copy %s: path too long", src);
+    }
+    wcscpy(src_path, wsrc);
+    wcscpy(dst_path, wdst);
+    lua_pop(L, 2);
+    DWORD attributes = GetFileAttributesW(src_path);
+    int result = -1;
+    if (attributes != INVALID_FILE_ATTRIBUTES) {
+      if (!(attributes & FILE_ATTRIBUTE_DIRECTORY))
+        result = copy_file_unlinked(src_path, dst_path) ? 0 : -1;
+      else if (CreateDirectoryW(dst_path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS)
+        result = copy_tree_recursive(src_path, wcslen(src_path), dst_path, wcslen(dst_path), hidden);
+    }
+    if (result) {
+      DWORD error = GetLastError();
+      const char* path = lua_toutf8(L, src_path);
+      free(src_path);
+      return luaL_win32_error(L, error, "can't copy %s", path);
+    }
+    free(src_path);
+  #else
+    copy_tree_t context = { .hidden = hidden };
+    struct stat s;
+    size_t src_len = strlen(src);
+    if (src_len >= sizeof(context.path))
+      return luaL_error(L, "can't copy %s: %s", src, strerror(ENAMETOOLONG));
+    memcpy(context.path, src, src_len + 1);
+    int result = stat(src, &s);
+    if (result == 0 && !S_ISDIR(s.st_mode)) {
+      result = copy_file_at(AT_FDCWD, src, AT_FDCWD, dst, &s);
+    } else if (result == 0) {
+      int src_dir = -1, dst_dir = -1;
+      if ((mkdir(dst, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) && errno != EEXIST) ||
+        (src_dir = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+        (dst_dir = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+        copy_tree_at(&context, src_len, src_dir, dst_dir))
+        result = -1;
+      int error = errno;
+      if (src_dir != -1)
+        close(src_dir);
+      if (dst_dir != -1)
+        close(dst_dir);
+      errno = error;
+    }
+    if (result)
+      return luaL_error(L, "can't copy %s: %s", context.path, strerror(errno));
+  #endif
+  return 0;
+}
+
+// Whether a blob in the store still has the content it's named after. Installed files are hardlinks to their blob, so
+// an in-place edit of one changes the blob too; that changes its mtime, so this is normally answered by the hash cache.
+static int store_blob_intact(lua_State* L, const char* blob, const unsigned char* digest) {
+  unsigned char blob_digest[32];
+  return hash_path(L, blob, blob_digest) == 0 && memcmp(blob_digest, digest, sizeof(blob_digest)) == 0;
+}
+
+// Makes dst a hardlink to src's blob in a content-addressed store, named after its sha256, adding the blob if needed,
+// or replacing it if it's been modified. Falls back to a plain copy if the store is on another device, or the blob has
+// different permissions; returns whether it linked.
+static int lpm_store(lua_State* L) {
+  const char* src = luaL_checkstring(L, 1);
+  const char* dst = luaL_checkstring(L, 2);
+  const char* store = luaL_checkstring(L, 3);
+  unsigned char digest[32];
+  int error = hash_path(L, src, digest);
+  if (error)
+    return luaL_error(L, "can't %s %s", error < 0 ? "open" : "read", src);
+  lua_pushstring(L, store);
+  #ifdef _WIN32
+    lua_pushliteral(L, "\\");
+  #else
+    lua_pushliteral(L, "/");
+  #endif
+  lua_pushhexstring(L, digest, sizeof(digest));
+  lua_concat(L, 3);
+  const char* blob = lua_tostring(L, -1);
+  #ifdef _WIN32
+    LPCWSTR wsrc = lua_toutf16(L, src), wdst = lua_toutf16(L, dst), wblob = lua_toutf16(L, blob);
+    WIN32_FILE_ATTRIBUTE_DATA src_data, blob_data;
+    if (!GetFileAttributesExW(wsrc, GetFileExInfoStandard, &src_data))
+      return luaL_win32_error(L, GetLastError(), "can't stat %s", src);
+    if (!GetFileAttributesExW(wblob, GetFileExInfoStandard, &blob_data) || blob_data.nFileSizeHigh != src_data.nFileSizeHigh || blob_data.nFileSizeLow != src_data.nFileSizeLow || !store_blob_intact(L, blob, digest)) {
+      wchar_t temporary_path[MAX_PATH];
+      _snwprintf(temporary_path, MAX_PATH, L"%ls.%d", wblob, _getpid());
+      if (!CopyFileW(wsrc, temporary_path, FALSE) || !MoveFileExW(temporary_path, wblob, MOVEFILE_REPLACE_EXISTING)) {
+        DWORD error = GetLastError();
+        DeleteFileW(temporary_path);
+        return luaL_win32_error(L, error, "can't store %s", src);
+      }
+    }
+    if (!DeleteFileW(wdst) && GetLastError() != ERROR_FILE_NOT_FOUND)
+      return luaL_win32_error(L, GetLastError(), "can't replace %s", dst);
+    int linked = CreateHardLinkW(wdst, wblob, NULL);
+    if (!linked && !CopyFileW(wsrc, wdst, FALSE))
+      return luaL_win32_error(L, GetLastError(), "can't copy %s", src);
+  #else
+    struct stat src_stat, blob_stat;
+    if (stat(src, &src_stat))
+      return luaL_error(L, "can't stat %s: %s", src, strerror(errno));
+    if (stat(blob, &blob_stat) || blob_stat.st_size != src_stat.st_size || !store_blob_intact(L, blob, digest)) {
+      char temporary_path[MAX_PATH];
+      snprintf(temporary_path, MAX_PATH, "%s.%d", blob, (int)getpid());
+      if (copy_file_at(AT_FDCWD, src, AT_FDCWD, temporary_path, &src_stat) || rename(temporary_path, blob)) {
+        int error = errno;
+        unlink(temporary_path);
+        return luaL_error(L, "can't store %s: %s", src, strerror(error));
+      }
+      blob_stat = src_stat;
+    }
+    if (unlink(dst) && errno != ENOENT)
+      return luaL_error(L, "can't replace %s: %s", dst, strerror(errno));
+    int linked = (blob_stat.st_mode & 07777) == (src_stat.st_mode & 07777) && link(blob, dst) == 0;
+    if (!linked && copy_file_at(AT_FDCWD, src, AT_FDCWD, dst, &src_stat))
+      return luaL_error(L, "can't copy %s: %s", src, strerror(errno));
+  #endif
+  lua_pushboolean(L, linked);
+  return 1;
+}
+
+#ifdef _WIN32
+  static int rmrf_recursive(wchar_t* path, size_t len) {
+    WIN32_FIND_DATAW fd;
+    wcscpy(&path[len], L"\\*");
+    HANDLE find = FindFirstFileExW(path, FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, 0);
+    path[len] = 0;
+    if (find == INVALID_HANDLE_VALUE)
+      return -1;
+    int result = 0;
+    do {
+      if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+        continue;
+      size_t name_len = wcslen(fd.cFileName);
+      if (len + name_len + 2 > WIDE_MAX_PATH) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        result = -1;
+        break;
+      }
+      path[len] = L'\\';
+      wcscpy(&path[len + 1], fd.cFileName);
+      if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+        // Directory symlinks and junctions are removed, not followed.
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && rmrf_recursive(path, len + 1 + name_len))
+          result = -1;
+        else if (!RemoveDirectoryW(path) && (GetLastError() != ERROR_ACCESS_DENIED || !SetFileAttributesW(path, FILE_ATTRIBUTE_NORMAL) || !RemoveDirectoryW(path)))
+          result = -1;
+      } else if (!DeleteFileW(path) && (GetLastError() != ERROR_ACCESS_DENIED || !SetFileAttributesW(path, FILE_ATTRIBUTE_NORMAL) || !DeleteFileW(path)))
+        result = -1;
+      if (result)
+        break;
+      path[len] = 0;
+    } while (FindNextFileW(find, &fd));
+    DWORD error = GetLastError();
+    FindClose(find);
+    SetLastError(error);
+    return result;
+  }
+#else
+  #define RMRF_MAX_THREADS 8
+
+  // Directories are emptied of everything else in parallel, and then removed in reverse order of discovery, which
+  // guarantees children go before their parents.
+  typedef struct {
+    int root;
+    char** directories; // Relative to root; the first is always ".".
+    size_t count;
+    size_t capacity;
+    size_t next;
+    int active;
+    int error;
+    char error_path[MAX_PATH];
+    lpm_mutex_t* mutex;
+    #ifndef LPM_NO_THREADS
+      pthread_cond_t changed; // Signalled whenever a directory is queued or finished, or something fails.
+    #endif
+  } rmrf_t;
+
+  static void rmrf_signal(rmrf_t* rmrf) {
+    #ifndef LPM_NO_THREADS
+      pthread_cond_broadcast(&rmrf->changed);
+    #endif
+  }
+
+  static int rmrf_failed(rmrf_t* rmrf) {
+    lock_mutex(rmrf->mutex);
+    int error = rmrf->error;
+    unlock_mutex(rmrf->mutex);
+    return error;
+  }
+
+  // Opens a directory that should be under dirfd, without following symlinks.
+  static int rmrf_openat(int dirfd, const char* name) {
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat s;
+    if (fd == -1 && errno == EACCES && fstatat(dirfd, name, &s, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(s.st_mode) && fchmodat(dirfd, name, S_IRWXU, 0) == 0)
+      fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    return fd;
+  }
+
+  // Opens a directory relative to root one component at a time, so that nothing along the way can be swapped for a
+  // symlink that takes us out of the tree.
+  static int rmrf_open(rmrf_t* rmrf, const char* directory, size_t len) {
+    if (len == 0 || (len == 1 && directory[0] == '.'))
+      return openat(rmrf->root, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fd = rmrf->root;
+    for (size_t offset = 0; offset < len;) {
+      char name[NAME_MAX + 1];
+      const char* separator = memchr(&directory[offset], '/', len - offset);
+      size_t name_len = (separator ? (size_t)(separator - directory) : len) - offset;
+      if (name_len > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        name_len = 0;
+      } else {
+        memcpy(name, &directory[offset], name_len);
+        name[name_len] = 0;
+      }
+      int child = name_len ? rmrf_openat(fd, name) : -1;
+      int error = errno;
+      if (fd != rmrf->root)
+        close(fd);
+      if (child == -1) {
+        errno = error;
+        return -1;
       }
-      return 1;
+      fd = child;
+      offset += name_len + 1;
     }
-    return lua_yieldk(L, 0, (lua_KContext)ctx, lpm_fetchk);
+    return fd;
   }
 
+  static void rmrf_fail(rmrf_t* rmrf, const char* directory, const char* name, int error) {
+    lock_mutex(rmrf->mutex);
+    if (!rmrf->error) {
+      rmrf->error = error;
+      if (name && strcmp(directory, ".") == 0)
+        snprintf(rmrf->error_path, sizeof(rmrf->error_path), "%s", name);
+      else
+        snprintf(rmrf->error_path, sizeof(rmrf->error_path), "%s%s%s", directory, name ? "/" : "", name ? name : "");
+      rmrf_signal(rmrf);
+    }
+    unlock_mutex(rmrf->mutex);
+  }
 
-  static int lpm_fetch(lua_State* L) {
-    git_init();
-    int args = lua_gettop(L);
-    fetch_context_t* context = lua_newuserdata(L, sizeof(fetch_context_t));
-    memset(context, 0, sizeof(fetch_context_t));
-    context->repository = luaL_checkgitrepo(L, 1);
-    const char* refspec = args >= 3 ? luaL_optstring(L, 3, NULL) : NULL;
-    context->depth = args >= 4 && !lua_isnil(L, 4) && !lua_toboolean(L, 4) ? 1 : GIT_FETCH_DEPTH_FULL;
-    if (args >= 5 && lua_isstring(L, 5)) {
-      git_proxy_options_init(&context->proxy_options, GIT_PROXY_OPTIONS_VERSION);
-      strncpy(context->proxy_url, lua_tostring(L, 5), sizeof(context->proxy_url));
-      context->proxy_options.type = GIT_PROXY_SPECIFIED;
-      context->proxy_options.credentials = NULL;
-      context->proxy_options.certificate_check = NULL;
-      context->proxy_options.url = context->proxy_url;
-    } else {
-      git_proxy_options_init(&context->proxy_options, GIT_PROXY_OPTIONS_VERSION);
-      context->proxy_options.type = GIT_PROXY_NONE;
+  static int rmrf_push(rmrf_t* rmrf, const char* directory, const char* name) {
+    size_t directory_len = strcmp(directory, ".") == 0 ? 0 : strlen(directory), name_len = strlen(name);
+    char* path = malloc(directory_len + name_len + 2);
+    if (!path)
+      return -1;
+    if (directory_len) {
+      memcpy(path, directory, directory_len);
+      path[directory_len++] = '/';
     }
-    context->L = L;
-    context->threaded = !lua_is_main_thread(L);
-    if (refspec)
-      strncpy(context->refspec, refspec, sizeof(context->refspec));
-    if (lua_type(L, 2) == LUA_TFUNCTION) {
-      lua_pushvalue(L, 2);
-      context->callback_function = luaL_ref(L, LUA_REGISTRYINDEX);
+    memcpy(&path[directory_len], name, name_len + 1);
+    lock_mutex(rmrf->mutex);
+    if (rmrf->count == rmrf->capacity) {
+      size_t capacity = rmrf->capacity ? rmrf->capacity * 2 : 64;
+      char** directories = realloc(rmrf->directories, sizeof(char*) * capacity);
+      if (!directories) {
+        unlock_mutex(rmrf->mutex);
+        free(path);
+        return -1;
+      }
+      rmrf->directories = directories;
+      rmrf->capacity = capacity;
     }
-    int ctx = luaL_ref(L, LUA_REGISTRYINDEX);
-    if (lua_is_main_thread(L)) {
-      lpm_fetch_thread(context);
-      return lpm_fetchk(L, 0, ctx);
-    } else {
-      context->thread = create_thread(lpm_fetch_thread, context);
-      return lua_yieldk(L, 0, (lua_KContext)ctx, lpm_fetchk);
+    rmrf->directories[rmrf->count++] = path;
+    rmrf_signal(rmrf);
+    unlock_mutex(rmrf->mutex);
+    return 0;
+  }
+
+  static void rmrf_directory(rmrf_t* rmrf, const char* directory) {
+    int fd = rmrf_open(rmrf, directory, strlen(directory));
+    DIR* dir = fd != -1 ? fdopendir(fd) : NULL;
+    if (!dir) {
+      rmrf_fail(rmrf, directory, NULL, errno);
+      if (fd != -1)
+        close(fd);
+      return;
+    }
+    int chmoded = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) && !rmrf_failed(rmrf)) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+      int is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN) {
+        struct stat s;
+        is_dir = fstatat(fd, entry->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(s.st_mode);
+      }
+      if (is_dir) {
+        if (rmrf_push(rmrf, directory, entry->d_name))
+          rmrf_fail(rmrf, directory, entry->d_name, ENOMEM);
+      } else if (unlinkat(fd, entry->d_name, 0)) {
+        // Directories we can't write to can be chmod'd, so long as we own them.
+        if ((errno == EACCES || errno == EPERM) && !chmoded && fchmod(fd, S_IRWXU) == 0 && (chmoded = 1) && unlinkat(fd, entry->d_name, 0) == 0)
+          continue;
+        rmrf_fail(rmrf, directory, entry->d_name, errno);
+      }
     }
+    closedir(dir);
   }
-#else
-  static int lpm_init(lua_State* L) { return luaL_error(L, "this binary was compiled without git support"); }
-  static int lpm_fetch(lua_State* L) { return luaL_error(L, "this binary was compiled without git support"); }
-  static int lpm_reset(lua_State* L) { return luaL_error(L, "this binary was compiled without git support"); }
-#endif
 
-static int mkdirp(lua_State* L, char* path, int len) {
-  for (int i = 0; i < len; ++i) {
-    if (path[i] == '/' && i > 0) {
-      path[i] = 0;
-      #ifdef _WIN32
-        LPCWSTR wpath = lua_toutf16(L, path);
-        if (_wmkdir(wpath) && errno != EEXIST) {
-          lua_pop(L, 1);
-          return -1;
-        }
-        lua_pop(L, 1);
-      #else
-        if (mkdir(path, S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH) && errno != EEXIST)
-          return -1;
-      #endif
-      path[i] = '/';
+  static void* rmrf_worker(void* data) {
+    rmrf_t* rmrf = data;
+    while (1) {
+      lock_mutex(rmrf->mutex);
+      if (rmrf->error || (rmrf->next >= rmrf->count && rmrf->active == 0)) {
+        unlock_mutex(rmrf->mutex);
+        break;
+      }
+      if (rmrf->next >= rmrf->count) {
+        // Other workers are still going, and may yet find more directories.
+        #ifndef LPM_NO_THREADS
+          pthread_cond_wait(&rmrf->changed, &rmrf->mutex->mutex);
+        #endif
+        unlock_mutex(rmrf->mutex);
+        continue;
+      }
+      const char* directory = rmrf->directories[rmrf->next++];
+      rmrf->active++;
+      unlock_mutex(rmrf->mutex);
+      rmrf_directory(rmrf, directory);
+      lock_mutex(rmrf->mutex);
+      if (--rmrf->active == 0)
+        rmrf_signal(rmrf);
+      unlock_mutex(rmrf->mutex);
     }
+    return NULL;
   }
+
+  static int rmrf_rmdir(rmrf_t* rmrf, const char* directory) {
+    const char* separator = strrchr(directory, '/');
+    int parent = separator ? rmrf_open(rmrf, directory, separator - directory) : rmrf->root;
+    if (parent == -1)
+      return -1;
+    const char* name = separator ? separator + 1 : directory;
+    int result = unlinkat(parent, name, AT_REMOVEDIR);
+    if (result && (errno == EACCES || errno == EPERM) && fchmod(parent, S_IRWXU) == 0)
+      result = unlinkat(parent, name, AT_REMOVEDIR);
+    int error = errno;
+    if (parent != rmrf->root)
+      close(parent);
+    errno = error;
+    return result;
+  }
+#endif
+
+// Removes a file, symlink, or directory tree. Like rm -rf, doesn't complain if the path doesn't exist, and will
+// make things writable if necessary to remove them.
+static int lpm_rmrf(lua_State* L) {
+  const char* path = luaL_checkstring(L, 1);
+  mkdirp_forget();
+  #ifdef _WIN32
+    wchar_t* wpath = malloc(sizeof(wchar_t) * WIDE_MAX_PATH);
+    if (!wpath)
+      return luaL_error(L, "can't allocate memory to remove %s", path);
+    LPCWSTR converted = lua_toutf16(L, path);
+    if (wcslen(converted) >= WIDE_MAX_PATH) {
+      free(wpath);
+      return luaL_error(L, "can't remove %s: path too long", path);
+    }
+    wcscpy(wpath, converted);
+    lua_pop(L, 1);
+    int result = 0;
+    DWORD attributes = GetFileAttributesW(wpath);
+    if (attributes == INVALID_FILE_ATTRIBUTES) {
+      if (GetLastError() != ERROR_FILE_NOT_FOUND && GetLastError() != ERROR_PATH_NOT_FOUND)
+        result = -1;
+    } else if (attributes & FILE_ATTRIBUTE_DIRECTORY) {
+      if (!(attributes & FILE_ATTRIBUTE_REPARSE_POINT) && rmrf_recursive(wpath, wcslen(wpath)))
+        result = -1;
+      else if (!RemoveDirectoryW(wpath) && (GetLastError() != ERROR_ACCESS_DENIED || !SetFileAttributesW(wpath, FILE_ATTRIBUTE_NORMAL) || !RemoveDirectoryW(wpath)))
+        result = -1;
+    } else if (!DeleteFileW(wpath) && (GetLastError() != ERROR_ACCESS_DENIED || !SetFileAttributesW(wpath, FILE_ATTRIBUTE_NORMAL) || !DeleteFileW(wpath)))
+      result = -1;
+    if (result) {
+      DWORD error = GetLastError();
+      const char* failed_path = lua_toutf8(L, wpath);
+      free(wpath);
+      return luaL_win32_error(L, error, "can't remove %s", failed_path);
+    }
+    free(wpath);
+  #else
+    struct stat s;
+    if (lstat(path, &s))
+      return errno == ENOENT ? 0 : luaL_error(L, "can't remove %s: %s", path, strerror(errno));
+    if (!S_ISDIR(s.st_mode)) {
+      if (unlink(path))
+        return luaL_error(L, "can't remove %s: %s", path, strerror(errno));
+      return 0;
+    }
+    rmrf_t rmrf = {0};
+    rmrf.root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rmrf.root == -1)
+      return luaL_error(L, "can't remove %s: %s", path, strerror(errno));
+    rmrf.mutex = new_mutex();
+    #ifndef LPM_NO_THREADS
+      pthread_cond_init(&rmrf.changed, NULL);
+    #endif
+    if (rmrf_push(&rmrf, ".", "."))
+      rmrf.error = ENOMEM;
+    else {
+      // Do the root ourselves; only bother spinning up threads if there's more than one directory under it.
+      rmrf.next = 1;
+      rmrf_directory(&rmrf, ".");
+      lpm_thread_t* threads[RMRF_MAX_THREADS];
+      int thread_count = imin(imin(cpu_count(), RMRF_MAX_THREADS), (int)(rmrf.count - rmrf.next));
+      for (int i = 1; i < thread_count; ++i)
+        threads[i] = create_thread(rmrf_worker, &rmrf);
+      rmrf_worker(&rmrf);
+      for (int i = 1; i < thread_count; ++i)
+        join_thread(threads[i]);
+    }
+    for (size_t i = rmrf.count; !rmrf.error && i > 1; --i) {
+      if (rmrf_rmdir(&rmrf, rmrf.directories[i - 1]))
+        rmrf_fail(&rmrf, rmrf.directories[i - 1], NULL, errno);
+    }
+    for (size_t i = 0; i < rmrf.count; ++i)
+      free(rmrf.directories[i]);
+    free(rmrf.directories);
+    #ifndef LPM_NO_THREADS
+      pthread_cond_destroy(&rmrf.changed);
+    #endif
+    free_mutex(rmrf.mutex);
+    close(rmrf.root);
+    if (rmrf.error)
+      return luaL_error(L, "can't remove %s/%s: %s", path, rmrf.error_path, strerror(rmrf.error));
+    if (rmdir(path))
+      return luaL_error(L, "can't remove %s: %s", path, strerror(errno));
+  #endif
   return 0;
 }
 
@@ -955,6 +2718,85 @@ static const char* strip_to_tar(char* dst, const char* src) {
   return dst;
 }
 
+// Moves to the record following the current header, given the real size of the entry's data. Unlike
+// mtar_next, doesn't re-read the raw header, so respects sizes overriden by extended headers, and partial reads.
+static int tar_next(mtar_t* tar, unsigned size) {
+  tar->remaining_data = 0;
+  return mtar_seek(tar, tar->last_header + 512 + ((size + 511) & ~511u));
+}
+
+#define TAR_MAX_PAX_SIZE (1024 * 1024)
+static int tar_parse_pax_number(const char* value, size_t len, unsigned* result) {
+  unsigned long long number = 0;
+  size_t i = 0;
+  for (; i < len && isdigit(value[i]); ++i) {
+    number = number * 10 + (value[i] - '0');
+    if (number > 0xFFFFFFFFull)
+      return -1;
+  }
+  if (i == 0 || i < len)
+    return -1;
+  *result = (unsigned)number;
+  return 0;
+}
+
+// PAX times are seconds since the epoch, optionally negative, and optionally with a fraction; the header can only hold
+// whole, unsigned 32-bit seconds, so anything outside that is clamped, and fractions are dropped.
+static int tar_parse_pax_time(const char* value, size_t len, unsigned* result) {
+  size_t i = value[0] == '-' ? 1 : 0, digits = i;
+  unsigned long long number = 0;
+  for (; i < len && isdigit(value[i]); ++i)
+    number = number > 0xFFFFFFFFull ? number : number * 10 + (value[i] - '0');
+  if (i == digits)
+    return -1;
+  if (i < len && value[i] == '.')
+    for (++i; i < len && isdigit(value[i]); ++i);
+  if (i < len)
+    return -1;
+  *result = value[0] == '-' ? 0 : (number > 0xFFFFFFFFull ? 0xFFFFFFFFu : (unsigned)number);
+  return 0;
+}
+
+// Parses the records of a PAX extended header, which look like "<length> <key>=<value>\n", where length includes
+// the entire record. Values may contain anything, including newlines and '=', so we go strictly by length. Only
+// path, linkpath, size and mtime are used; ownership and the like are skipped unparsed.
+static int tar_parse_pax(const char* data, size_t len, mtar_header_t* h) {
+  size_t offset = 0;
+  while (offset < len && data[offset]) {
+    const char* record = &data[offset];
+    size_t record_length = 0, i = 0;
+    for (; offset + i < len && isdigit(record[i]) && record_length <= len; ++i)
+      record_length = record_length * 10 + (record[i] - '0');
+    if (i == 0 || offset + i >= len || record[i] != ' ' || record_length <= i + 1 || record_length > len - offset || record[record_length - 1] != '\n')
+      return -1;
+    const char* key = &record[i + 1];
+    const char* end = &record[record_length - 1];
+    const char* value = memchr(key, '=', end - key);
+    if (!value)
+      return -1;
+    size_t key_length = value++ - key, value_length = end - value;
+    if (key_length == 4 && strncmp(key, "path", 4) == 0) {
+      if (value_length >= sizeof(h->name))
+        return -1;
+      memcpy(h->name, value, value_length);
+      h->name[value_length] = 0;
+    } else if (key_length == 8 && strncmp(key, "linkpath", 8) == 0) {
+      if (value_length >= sizeof(h->linkname))
+        return -1;
+      memcpy(h->linkname, value, value_length);
+      h->linkname[value_length] = 0;
+    } else if (key_length == 4 && strncmp(key, "size", 4) == 0) {
+      if (tar_parse_pax_number(value, value_length, &h->size))
+        return -1;
+    } else if (key_length == 5 && strncmp(key, "mtime", 5) == 0) {
+      if (tar_parse_pax_time(value, value_length, &h->mtime))
+        return -1;
+    }
+    offset += record_length;
+  }
+  return 0;
+}
+
 static int lpm_extract(lua_State* L) {
   const char* src = luaL_checkstring(L, 1);
   const char* dst = luaL_checkstring(L, 2);
@@ -1144,12 +2986,13 @@ static int lpm_extract(lua_State* L) {
           case MTAR_TDIR:
           case MTAR_TCON:
           case MTAR_TREG: {
+            // Global extended headers apply to everything after them, and per-file ones take precedence.
+            if (has_ext_always)
+              mtar_update_header(&h, &always_h);
             if (has_ext_before) {
               mtar_update_header(&h, &before_h);
               has_ext_before = 0;
               mtar_clear_header(&before_h);
-            } else if (has_ext_always) {
-              mtar_update_header(&h, &always_h);
             }
             int target_length = snprintf(target, sizeof(target), "%s/%s", dst, h.name);
 
@@ -1174,7 +3017,14 @@ static int lpm_extract(lua_State* L) {
                 return luaL_error(L, "can't extract tar archive file %s, can't create file %s: %s", src, target, strerror(errno));
               }
               char buffer[8192];
-              int remaining = h.size;
+              unsigned remaining = h.size;
+              // The size may have come from an extended header, so position ourselves rather than have microtar read the raw one.
+              if (remaining > 0 && (err = mtar_seek(&tar, tar.last_header + 512))) {
+                fclose(file);
+                mtar_close(&tar);
+                return luaL_error(L, "can't read file %s: %s", target, mtar_strerror(err));
+              }
+              tar.remaining_data = remaining;
               while (remaining > 0) {
                 int read_size = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
                 int err = mtar_read_data(&tar, buffer, read_size);
@@ -1204,48 +3054,28 @@ static int lpm_extract(lua_State* L) {
               has_ext_always = 1;
             }
 
-            char buffer[4096] = {0};
-            char current_read[8192] = {0}; // If a line is more than 8192 char long, will not work!
-            char last_read[4096] = {0};
-            int remaining = h.size;
-
-
-            while (remaining > 0) {
-              int read_size = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
-              remaining -= read_size;
-
-              if (mtar_read_data(&tar, buffer, read_size) != MTAR_ESUCCESS) {
+            // Extended headers only hold a few paths; anything this size is either broken or hostile.
+            if (h.size > TAR_MAX_PAX_SIZE) {
+              mtar_close(&tar);
+              return luaL_error(L, "can't extract tar archive %s: extended header is too large", src);
+            }
+            if (h.size > 0) {
+              char* data = malloc(h.size);
+              if (!data) {
+                mtar_close(&tar);
+                return luaL_error(L, "can't allocate %d bytes for extended header", (int)h.size);
+              }
+              if (mtar_read_data(&tar, data, h.size) != MTAR_ESUCCESS) {
+                free(data);
                 mtar_close(&tar);
                 return luaL_error(L, "Error while reading extended: %s", strerror(errno));
               }
-
-              strcpy(current_read, last_read);
-              current_read[strlen(last_read)] = '\0';
-              strcat(current_read, buffer);
-              current_read[strlen(last_read) + read_size] = '\0';
-
-              char *n_line_ptr = NULL;
-              char **l_line_ptr = NULL;
-              char *line = strtok_r(current_read, "\n", &n_line_ptr);
-
-              while (line != NULL) {
-                char *in_line_ptr = NULL;
-                strtok_r(line, " ", &in_line_ptr);
-                char *header_key = strtok_r(NULL, "=", &in_line_ptr);
-                char *header_val = strtok_r(NULL, "=", &in_line_ptr);
-
-                if (!strcmp(header_key, "path"))      strcpy(h_to_change->name, header_val);
-                if (!strcmp(header_key, "linkpath"))  strcpy(h_to_change->linkname, header_val);
-                  // possibility to add more later
-
-                l_line_ptr = &n_line_ptr;
-                line = strtok_r(NULL, "\n", &n_line_ptr);
+              int parse_error = tar_parse_pax(data, h.size, h_to_change);
+              free(data);
+              if (parse_error) {
+                mtar_close(&tar);
+                return luaL_error(L, "can't extract tar archive %s: malformed extended header", src);
               }
-
-              if (current_read[strlen(last_read) + read_size - 1] != '\n')
-                strcpy(last_read, strtok_r(current_read, "\n", l_line_ptr));
-              else
-                memset(last_read, 0, strlen(last_read));
             }
           } break;
           case MTAR_TGFP: {
@@ -1265,8 +3095,7 @@ static int lpm_extract(lua_State* L) {
             }
           } break;
         }
-        int err;
-        if ((err = mtar_next(&tar))) {
+        if ((err = tar_next(&tar, h.size))) {
           mtar_close(&tar);
           return luaL_error(L, "Error while reading tar archive: %s", mtar_strerror(err));
         }
@@ -1942,6 +3771,7 @@ static int lpm_extract(lua_State* L) {
 
 
 static int lpm_chdir(lua_State* L) {
+  mkdirp_forget();
   #ifdef _WIN32
     if (_wchdir(lua_toutf16(L, luaL_checkstring(L, 1))))
   #else
@@ -2036,6 +3866,17 @@ static int lpm_time(lua_State* L) {
   return 1;
 }
 
+static int lpm_sleep(lua_State* L) {
+  double seconds = luaL_checknumber(L, 1);
+  #if _WIN32
+    Sleep((DWORD)(seconds * 1000));
+  #else
+    struct timespec ts = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1000000000.0) };
+    nanosleep(&ts, NULL);
+  #endif
+  return 0;
+}
+
 static int lpm_setenv(lua_State* L) {
 #ifdef _WIN32
   if (!SetEnvironmentVariableW(lua_toutf16(L, luaL_checkstring(L, 1)), lua_toutf16(L, luaL_checkstring(L, 2))))
@@ -2077,16 +3918,577 @@ static int lpm_utctime(lua_State* L) {
   return 1;
 }
 
+/** JSON; decodes straight into lua tables, producing the same values as the rxi decoder this replaced. **/
+typedef struct {
+  lua_State* L;
+  const char* start;
+  const char* end;
+  int depth;
+} json_decoder_t;
+
+static const int json_max_depth = 512;
+
+static int json_error(json_decoder_t* decoder, const char* position, const char* format, ...) {
+  int line = 1, col = 1;
+  // Positions can be just past the end of input; they're counted as columns, as they were by the lua decoder.
+  for (const char* p = decoder->start; p < position; ++p) {
+    ++col;
+    if (p < decoder->end && *p == '\n') {
+      ++line;
+      col = 1;
+    }
+  }
+  va_list va;
+  va_start(va, format);
+  const char* message = lua_pushvfstring(decoder->L, format, va);
+  va_end(va);
+  return luaL_error(decoder->L, "%s at line %d col %d", message, line, col);
+}
+
+static const char* json_skip_space(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    ++p;
+  return p;
+}
+
+static const char* json_scan_string(const char* p, const char* end) {
+  #ifdef LPM_JSON_SIMD
+    #ifdef __SSE2__
+      const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1F);
+      for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)), _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+        int mask = _mm_movemask_epi8(found);
+        if (mask)
+          return p + __builtin_ctz(mask);
+      }
+    #else
+      const uint8x16_t quote = vdupq_n_u8('"'), backslash = vdupq_n_u8('\\'), control = vdupq_n_u8(0x20);
+      for (; end - p >= 16; p += 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t*)p);
+        uint8x16_t found = vorrq_u8(vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)), vcltq_u8(chunk, control));
+        // Narrows each byte of the comparison to a nibble, so the first match can be found in a single 64-bit word.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(found), 4)), 0);
+        if (mask)
+          return p + (__builtin_ctzll(mask) >> 2);
+      }
+    #endif
+  #endif
+  while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 32)
+    ++p;
+  return p;
+}
+
+static int json_hex(const char* p, const char* end) {
+  int value = 0;
+  if (end - p < 4)
+    return -1;
+  for (int i = 0; i < 4; ++i) {
+    char c = p[i];
+    value <<= 4;
+    if (c >= '0' && c <= '9')
+      value |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      value |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      value |= c - 'A' + 10;
+    else
+      return -1;
+  }
+  return value;
+}
+
+static void json_add_codepoint(json_decoder_t* decoder, luaL_Buffer* b, const char* position, int n) {
+  if (n <= 0x7f)
+    luaL_addchar(b, n);
+  else if (n <= 0x7ff) {
+    luaL_addchar(b, 0xC0 | (n >> 6));
+    luaL_addchar(b, 0x80 | (n & 0x3F));
+  } else if (n <= 0xffff) {
+    luaL_addchar(b, 0xE0 | (n >> 12));
+    luaL_addchar(b, 0x80 | ((n >> 6) & 0x3F));
+    luaL_addchar(b, 0x80 | (n & 0x3F));
+  } else if (n <= 0x10ffff) {
+    luaL_addchar(b, 0xF0 | (n >> 18));
+    luaL_addchar(b, 0x80 | ((n >> 12) & 0x3F));
+    luaL_addchar(b, 0x80 | ((n >> 6) & 0x3F));
+    luaL_addchar(b, 0x80 | (n & 0x3F));
+  } else
+    json_error(decoder, position, "invalid unicode codepoint '%x'", n);
+}
+
+// Strings without escapes, which is nearly all of them, are pushed directly from the source.
+static const char* json_parse_string(json_decoder_t* decoder, const char* p) {
+  const char* end = decoder->end, *start = p + 1;
+  const char* q = json_scan_string(start, end);
+  if (q < end && *q == '"') {
+    lua_pushlstring(decoder->L, start, q - start);
+    return q + 1;
+  }
+  luaL_Buffer b;
+  luaL_buffinit(decoder->L, &b);
+  while (1) {
+    luaL_addlstring(&b, start, q - start);
+    if (q >= end)
+      json_error(decoder, p, "expected closing quote for string");
+    if (*q == '"')
+      break;
+    if ((unsigned char)*q < 32)
+      json_error(decoder, q, "control character in string");
+    char c = q + 1 < end ? q[1] : 0;
+    start = q + 2;
+    switch (c) {
+      case '"': case '\\': case '/': luaL_addchar(&b, c); break;
+      case 'b': luaL_addchar(&b, '\b'); break;
+      case 'f': luaL_addchar(&b, '\f'); break;
+      case 'n': luaL_addchar(&b, '\n'); break;
+      case 'r': luaL_addchar(&b, '\r'); break;
+      case 't': luaL_addchar(&b, '\t'); break;
+      case 'u': {
+        int n1 = json_hex(start, end), n2 = -1;
+        if (n1 < 0)
+          json_error(decoder, q, "invalid unicode escape in string");
+        start += 4;
+        // A high surrogate only combines with a low one; anything else is decoded on its own, like a lone surrogate.
+        if (n1 >= 0xD800 && n1 <= 0xDBFF && end - start >= 2 && start[0] == '\\' && start[1] == 'u' && (n2 = json_hex(start + 2, end)) >= 0xDC00 && n2 <= 0xDFFF)
+          start += 6;
+        else
+          n2 = -1;
+        json_add_codepoint(decoder, &b, q, n2 >= 0 ? (n1 - 0xD800) * 0x400 + (n2 - 0xDC00) + 0x10000 : n1);
+      } break;
+      default:
+        json_error(decoder, q, "invalid escape char '%c' in string", c);
+    }
+    q = json_scan_string(start, end);
+  }
+  luaL_pushresult(&b);
+  return q + 1;
+}
+
+// Numbers and literals run up to the next delimiter; numbers are whatever lua's tonumber makes of that.
+static const char* json_parse_token(json_decoder_t* decoder, const char* p) {
+  const char* end = decoder->end, *q = p;
+  while (q < end && *q != ' ' && *q != '\t' && *q != '\r' && *q != '\n' && *q != ']' && *q != '}' && *q != ',')
+    ++q;
+  size_t len = q - p;
+  if (*p == 't' || *p == 'f' || *p == 'n') {
+    if (len == 4 && memcmp(p, "true", 4) == 0)
+      lua_pushboolean(decoder->L, 1);
+    else if (len == 5 && memcmp(p, "false", 5) == 0)
+      lua_pushboolean(decoder->L, 0);
+    else if (len == 4 && memcmp(p, "null", 4) == 0)
+      lua_pushnil(decoder->L);
+    else
+      json_error(decoder, p, "invalid literal '%s'", lua_pushlstring(decoder->L, p, len));
+    return q;
+  }
+  char buffer[64];
+  const char* number = buffer;
+  if (len < sizeof(buffer)) {
+    memcpy(buffer, p, len);
+    buffer[len] = 0;
+  } else
+    number = lua_pushlstring(decoder->L, p, len);
+  if (lua_stringtonumber(decoder->L, number) != len + 1)
+    json_error(decoder, p, "invalid number '%s'", lua_pushlstring(decoder->L, p, len));
+  if (number != buffer)
+    lua_remove(decoder->L, -2);
+  return q;
+}
+
+static const char* json_parse_value(json_decoder_t* decoder, const char* p) {
+  lua_State* L = decoder->L;
+  const char* end = decoder->end;
+  if (p >= end)
+    json_error(decoder, p, "unexpected character ''");
+  switch (*p) {
+    case '"': return json_parse_string(decoder, p);
+    case '-': case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+    case 't': case 'f': case 'n':
+      return json_parse_token(decoder, p);
+    case '[': case '{': break;
+    default: json_error(decoder, p, "unexpected character '%c'", *p);
+  }
+  if (++decoder->depth > json_max_depth)
+    json_error(decoder, p, "too deeply nested");
+  luaL_checkstack(L, 4, "too deeply nested");
+  lua_newtable(L);
+  if (*p == '[') {
+    p = json_skip_space(p + 1, end);
+    if (p < end && *p == ']')
+      p++;
+    else {
+      for (lua_Integer n = 1; ; ++n) {
+        p = json_parse_value(decoder, p);
+        lua_rawseti(L, -2, n);
+        p = json_skip_space(p, end);
+        char c = p < end ? *p : 0;
+        p++;
+        if (c == ']')
+          break;
+        if (c != ',')
+          json_error(decoder, p, "expected ']' or ','");
+        p = json_skip_space(p, end);
+      }
+    }
+  } else {
+    p = json_skip_space(p + 1, end);
+    if (p < end && *p == '}')
+      p++;
+    else {
+      while (1) {
+        if (p >= end || *p != '"')
+          json_error(decoder, p, "expected string for key");
+        p = json_skip_space(json_parse_string(decoder, p), end);
+        if (p >= end || *p != ':')
+          json_error(decoder, p, "expected ':' after key");
+        p = json_parse_value(decoder, json_skip_space(p + 1, end));
+        lua_rawset(L, -3);
+        p = json_skip_space(p, end);
+        char c = p < end ? *p : 0;
+        p++;
+        if (c == '}')
+          break;
+        if (c != ',')
+          json_error(decoder, p, "expected '}' or ','");
+        p = json_skip_space(p, end);
+      }
+    }
+  }
+  --decoder->depth;
+  return p;
+}
+
+static int lpm_json_decode(lua_State* L) {
+  size_t len;
+  const char* str = luaL_checklstring(L, 1, &len);
+  json_decoder_t decoder = { L, str, str + len, 0 };
+  const char* p = json_parse_value(&decoder, json_skip_space(str, decoder.end));
+  p = json_skip_space(p, decoder.end);
+  if (p < decoder.end)
+    json_error(&decoder, p, "trailing garbage");
+  return 1;
+}
+
+// The encoder's output goes into a userdata at a fixed stack index, so that nothing leaks on error, and the rest of
+// the stack is free for walking tables. When writing to a file, it's flushed whenever it fills up, so even large
+// documents only ever take up a single chunk of memory.
+typedef struct {
+  lua_State* L;
+  FILE* file;
+  char* buffer;
+  size_t length, capacity;
+  int buffer_index, visiting_index;
+  int pretty;
+  const char* indent;
+  size_t indent_length;
+} json_encoder_t;
+
+typedef struct {
+  const char* key;
+  size_t len;
+  int index;
+} json_key_t;
+
+static const size_t json_chunk_size = 64 * 1024;
+
+static void json_flush(json_encoder_t* encoder) {
+  if (encoder->length && fwrite(encoder->buffer, 1, encoder->length, encoder->file) != encoder->length)
+    luaL_error(encoder->L, "can't write json: %s", strerror(errno));
+  encoder->length = 0;
+}
+
+static void json_write(json_encoder_t* encoder, const char* data, size_t len) {
+  if (encoder->length + len > encoder->capacity) {
+    if (encoder->file) {
+      json_flush(encoder);
+      if (len > encoder->capacity) {
+        if (fwrite(data, 1, len, encoder->file) != len)
+          luaL_error(encoder->L, "can't write json: %s", strerror(errno));
+        return;
+      }
+    } else {
+      size_t capacity = encoder->capacity * 2;
+      while (capacity < encoder->length + len)
+        capacity *= 2;
+      char* buffer = lua_newuserdatauv(encoder->L, capacity, 0);
+      memcpy(buffer, encoder->buffer, encoder->length);
+      lua_replace(encoder->L, encoder->buffer_index);
+      encoder->buffer = buffer;
+      encoder->capacity = capacity;
+    }
+  }
+  memcpy(&encoder->buffer[encoder->length], data, len);
+  encoder->length += len;
+}
+
+static void json_write_indent(json_encoder_t* encoder, int depth) {
+  for (int i = 0; i < depth; ++i)
+    json_write(encoder, encoder->indent, encoder->indent_length);
+}
+
+static void json_write_string(json_encoder_t* encoder, const char* str, size_t len) {
+  const char* end = str + len;
+  json_write(encoder, "\"", 1);
+  while (str < end) {
+    const char* q = json_scan_string(str, end);
+    json_write(encoder, str, q - str);
+    if (q == end)
+      break;
+    char escape[7] = { '\\', 0 };
+    switch (*q) {
+      case '"': case '\\': escape[1] = *q; break;
+      case '\b': escape[1] = 'b'; break;
+      case '\f': escape[1] = 'f'; break;
+      case '\n': escape[1] = 'n'; break;
+      case '\r': escape[1] = 'r'; break;
+      case '\t': escape[1] = 't'; break;
+      default: snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char)*q); break;
+    }
+    json_write(encoder, escape, strlen(escape));
+    str = q + 1;
+  }
+  json_write(encoder, "\"", 1);
+}
+
+// Keys of pretty-printed objects are sorted by their encoded form, as that's what the lua encoder did.
+static int json_compare_keys(const void* a, const void* b) {
+  const json_key_t* key1 = a, *key2 = b;
+  int result = memcmp(key1->key, key2->key, key1->len < key2->len ? key1->len : key2->len);
+  return result ? result : (key1->len > key2->len) - (key1->len < key2->len);
+}
+
+static void json_encode_value(json_encoder_t* encoder, int index, int depth);
+
+static void json_encode_table(json_encoder_t* encoder, int index, int depth) {
+  lua_State* L = encoder->L;
+  luaL_checkstack(L, 8, "too deeply nested");
+  lua_pushvalue(L, index);
+  if (lua_rawget(L, encoder->visiting_index) != LUA_TNIL)
+    luaL_error(L, "circular reference");
+  lua_pop(L, 1);
+  lua_pushvalue(L, index);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, encoder->visiting_index);
+  int is_array = lua_rawgeti(L, index, 1) != LUA_TNIL;
+  lua_pop(L, 1);
+  size_t count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    if (lua_type(L, -2) != (is_array ? LUA_TNUMBER : LUA_TSTRING))
+      luaL_error(L, "invalid table: mixed or invalid key types");
+    ++count;
+    lua_pop(L, 1);
+  }
+  if (is_array) {
+    if (count != lua_rawlen(L, index))
+      luaL_error(L, "invalid table: sparse array");
+    json_write(encoder, "[", 1);
+    for (size_t i = 1; i <= count; ++i) {
+      if (i > 1)
+        json_write(encoder, ",", 1);
+      if (encoder->pretty) {
+        json_write(encoder, "\n", 1);
+        json_write_indent(encoder, depth + 1);
+      }
+      lua_rawgeti(L, index, i);
+      json_encode_value(encoder, lua_gettop(L), depth + 1);
+      lua_pop(L, 1);
+    }
+    if (encoder->pretty) {
+      json_write(encoder, "\n", 1);
+      json_write_indent(encoder, depth);
+    }
+    json_write(encoder, "]", 1);
+  } else if (!encoder->pretty || count == 0) {
+    int first = 1;
+    json_write(encoder, "{", 1);
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      size_t len;
+      const char* key = lua_tolstring(L, -2, &len);
+      if (!first)
+        json_write(encoder, ",", 1);
+      first = 0;
+      json_write_string(encoder, key, len);
+      json_write(encoder, ":", 1);
+      json_encode_value(encoder, lua_gettop(L), depth + 1);
+      lua_pop(L, 1);
+    }
+    json_write(encoder, "}", 1);
+  } else {
+    // Encodes each key up front, with a scratch encoder of its own.
+    json_key_t* keys = lua_newuserdatauv(L, sizeof(json_key_t) * count, 0);
+    lua_createtable(L, count * 2, 0);
+    int keys_index = lua_gettop(L), i = 0;
+    char* scratch_buffer = lua_newuserdatauv(L, 256, 0);
+    json_encoder_t scratch = { L, NULL, scratch_buffer, 0, 256, lua_gettop(L) };
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+      size_t len;
+      const char* key = lua_tolstring(L, -2, &len);
+      scratch.length = 0;
+      json_write_string(&scratch, key, len);
+      lua_pushvalue(L, -2);
+      lua_rawseti(L, keys_index, ++i);
+      keys[i - 1].key = lua_pushlstring(L, scratch.buffer, scratch.length);
+      keys[i - 1].len = scratch.length;
+      keys[i - 1].index = i;
+      lua_rawseti(L, keys_index, count + i);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    qsort(keys, count, sizeof(json_key_t), json_compare_keys);
+    json_write(encoder, "{", 1);
+    for (size_t j = 0; j < count; ++j) {
+      json_write(encoder, j > 0 ? ",\n" : "\n", j > 0 ? 2 : 1);
+      json_write_indent(encoder, depth + 1);
+      json_write(encoder, keys[j].key, keys[j].len);
+      json_write(encoder, ": ", 2);
+      lua_rawgeti(L, keys_index, keys[j].index);
+      lua_rawget(L, index);
+      json_encode_value(encoder, lua_gettop(L), depth + 1);
+      lua_pop(L, 1);
+    }
+    json_write(encoder, "\n", 1);
+    json_write_indent(encoder, depth);
+    json_write(encoder, "}", 1);
+    lua_pop(L, 2);
+  }
+  lua_pushvalue(L, index);
+  lua_pushnil(L);
+  lua_rawset(L, encoder->visiting_index);
+}
+
+static void json_encode_value(json_encoder_t* encoder, int index, int depth) {
+  lua_State* L = encoder->L;
+  switch (lua_type(L, index)) {
+    case LUA_TNIL: json_write(encoder, "null", 4); break;
+    case LUA_TBOOLEAN: lua_toboolean(L, index) ? json_write(encoder, "true", 4) : json_write(encoder, "false", 5); break;
+    case LUA_TSTRING: {
+      size_t len;
+      const char* str = lua_tolstring(L, index, &len);
+      json_write_string(encoder, str, len);
+    } break;
+    case LUA_TNUMBER: {
+      char number[32];
+      lua_Number value = lua_tonumber(L, index);
+      if (value != value || value <= -HUGE_VAL || value >= HUGE_VAL)
+        luaL_error(L, "unexpected number value '%s'", luaL_tolstring(L, index, NULL));
+      json_write(encoder, number, snprintf(number, sizeof(number), "%.14g", value));
+    } break;
+    case LUA_TTABLE: json_encode_table(encoder, index, depth); break;
+    default: luaL_error(L, "unexpected type '%s'", luaL_typename(L, index));
+  }
+}
+
+// Encodes a value as JSON, with the options pretty and indent. If a file is passed, the JSON is streamed into it,
+// rather than returned as a string.
+static int lpm_json_encode(lua_State* L) {
+  lua_settop(L, 3);
+  json_encoder_t encoder = { L };
+  encoder.indent = "  ";
+  encoder.indent_length = 2;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "pretty");
+    encoder.pretty = lua_toboolean(L, -1);
+    if (lua_getfield(L, 2, "indent") != LUA_TNIL)
+      encoder.indent = luaL_checklstring(L, -1, &encoder.indent_length);
+  }
+  if (!lua_isnil(L, 3)) {
+    luaL_Stream* stream = luaL_checkudata(L, 3, LUA_FILEHANDLE);
+    if (!stream->closef)
+      return luaL_error(L, "attempt to use a closed file");
+    encoder.file = stream->f;
+  }
+  lua_newtable(L);
+  encoder.visiting_index = lua_gettop(L);
+  encoder.capacity = encoder.file ? json_chunk_size : 1024;
+  encoder.buffer = lua_newuserdatauv(L, encoder.capacity, 0);
+  encoder.buffer_index = lua_gettop(L);
+  json_encode_value(&encoder, 1, 0);
+  if (encoder.file) {
+    json_flush(&encoder);
+    return 0;
+  }
+  lua_pushlstring(L, encoder.buffer, encoder.length);
+  return 1;
+}
+
+
+// Runs an array of operations, each an array of a filesystem function's name followed by its arguments, in a single
+// call. Returns an array of each operation's first result, or true if it returns nothing. Stops at the first error,
+// additionally returning the error, and the index of the failing operation. Functions that signal failure by
+// returning nil and a message, like rename, are treated as having errored; except for stat, where that just means
+// nothing's there.
+static int lpm_batch(lua_State* L) {
+  static const char* names[] = { "chmod", "copy_tree", "exists", "mkdir", "mkdirp", "rename", "rmdir", "rmrf", "stat", "store", "symlink", "type", NULL };
+  static const lua_CFunction functions[] = { lpm_chmod, lpm_copy_tree, lpm_exists, lpm_mkdir, lpm_mkdirp, lpm_rename, lpm_rmdir, lpm_rmrf, lpm_stat, lpm_store, lpm_symlink, lpm_type };
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = lua_rawlen(L, 1);
+  lua_settop(L, 1);
+  lua_createtable(L, count, 0);
+  for (int i = 1; i <= count; ++i) {
+    if (lua_rawgeti(L, 1, i) != LUA_TTABLE)
+      return luaL_error(L, "expected an operation at index %d", i);
+    int op = lua_gettop(L), function = 0;
+    lua_rawgeti(L, op, 1);
+    const char* name = lua_tostring(L, -1);
+    while (names[function] && (!name || strcmp(names[function], name) != 0))
+      ++function;
+    if (!names[function])
+      return luaL_error(L, "unknown operation %s at index %d", name ? name : "?", i);
+    lua_pop(L, 1);
+    lua_pushcfunction(L, functions[function]);
+    int args = lua_rawlen(L, op);
+    for (int j = 2; j <= args; ++j)
+      lua_rawgeti(L, op, j);
+    int failed = lua_pcall(L, args - 1, LUA_MULTRET, 0);
+    int results = lua_gettop(L) - op;
+    if (!failed && results >= 2 && lua_isnil(L, op + 1) && lua_type(L, op + 2) == LUA_TSTRING && functions[function] != lpm_stat) {
+      lua_pushfstring(L, "can't %s %s", name, lua_tostring(L, op + 2));
+      failed = 1;
+    }
+    if (failed) {
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, -2);
+      lua_pushinteger(L, i);
+      return 3;
+    }
+    if (results > 0)
+      lua_pushvalue(L, op + 1);
+    else
+      lua_pushboolean(L, 1);
+    lua_rawseti(L, 2, i);
+    lua_settop(L, 2);
+  }
+  return 1;
+}
 
 static const luaL_Reg system_lib[] = {
-  { "ls",        lpm_ls    },    // Returns an array of files.
-  { "stat",      lpm_stat  },    // Returns info about a single file.
+  { "ls",        lpm_ls    },    // Returns an array of files, optionally with their types, sizes and modification times.
+  { "stat",      lpm_stat  },    // Returns info about a single file; quicker if only some fields are needed.
+  { "stat_fast", lpm_stat_fast }, // Returns info about a single file, without working out abs_path.
+  { "exists",    lpm_exists },   // Returns whether a path exists.
+  { "type",      lpm_type },     // Returns whether a path is a file or a directory.
   { "mkdir",     lpm_mkdir },    // Makes a directory.
+  { "mkdirp",    lpm_mkdirp },   // Makes a directory and any missing parents.
+  { "rename",    lpm_rename },   // Renames, or atomically swaps, a file or directory.
   { "rmdir",     lpm_rmdir },    // Removes a directory.
   { "hash",      lpm_hash  },    // Returns a hex sha256 hash.
+  { "hasher",    lpm_hasher },   // Returns an object that can incrementally compute a sha256 hash.
+  { "hash_many", lpm_hash_many }, // Returns hex sha256 hashes for an array of files, hashed in parallel.
+  { "tree_diff", lpm_tree_diff }, // Returns whether a file or directory tree differs from another.
+  { "tree_stamp", lpm_tree_stamp }, // Returns a hash of the metadata of everything under a directory.
+  { "json_decode", lpm_json_decode }, // Decodes a JSON string into lua values.
+  { "json_encode", lpm_json_encode }, // Encodes lua values as JSON, optionally streaming it to a file.
+  { "hash_cache", lpm_hash_cache }, // Sets the file used to persist file hashes between runs.
   { "tcflush",   lpm_tcflush },  // Flushes an terminal stream.
   { "tcwidth",   lpm_tcwidth },  // Gets the terminal width in columns.
   { "symlink",   lpm_symlink },  // Creates a symlink.
+  { "copy_tree", lpm_copy_tree }, // Copies a file or directory tree natively.
+  { "store",     lpm_store },    // Hardlinks a file from a content-addressed store.
+  { "rmrf",      lpm_rmrf },     // Removes a file or directory tree natively.
   { "chmod",     lpm_chmod },    // Chmod's a file.
   { "init",      lpm_init },     // Initializes a git repository with the specified remote.
   { "fetch",     lpm_fetch },    // Updates a git repository with the specified remote.
@@ -2099,8 +4501,10 @@ static const luaL_Reg system_lib[] = {
   { "pwd",       lpm_pwd },      // Gets existing directory. Only use for --post actions.
   { "flock",     lpm_flock },    // Locks a file.
   { "time",      lpm_time },     // Get high-precision system time.
+  { "sleep",     lpm_sleep },    // Sleeps for the specified number of seconds.
   { "setenv",    lpm_setenv },   // Sets a system environment variable.
   { "utctime",    lpm_utctime }, // Converts a local timestamp to a UTC timestamp.
+  { "batch",     lpm_batch },    // Runs an array of filesystem operations in one call.
   { NULL,        NULL }
 };
 
@@ -2161,6 +4565,7 @@ static const luaL_Reg system_lib[] = {
 
 
 int main(int argc, char* argv[]) {
+  sha256_setup();
   lua_State* L = luaL_newstate();
   luaL_openlibs(L);
   luaL_newlib(L, system_lib);
@@ -3,382 +3,8 @@ for k,v in pairs(_G) do _S[k] = true end
 function global(g) if #g > 0 then for i,v in ipairs(g) do rawset(_S, g[i], true) end else for k,v in pairs(g) do rawset(_G, k, v) rawset(_S, k, true) end end  end
 setmetatable(_G, { __index = function(t, k) if not rawget(_S, k) then error("cannot get undefined global variable: " .. k, 2) end end, __newindex = function(t, k, v) if rawget(_S, k) then rawset(t, k, v) else error("cannot set global variable: " .. k, 2) end end })
 
--- Begin rxi JSON library.
-global({ json = { _version = "0.1.2" } })
-local encode
-local escape_char_map = {
-  [ "\\" ] = "\\",
-  [ "\"" ] = "\"",
-  [ "\b" ] = "b",
-  [ "\f" ] = "f",
-  [ "\n" ] = "n",
-  [ "\r" ] = "r",
-  [ "\t" ] = "t",
-}
-
-local escape_char_map_inv = { [ "/" ] = "/" }
-for k, v in pairs(escape_char_map) do
-  escape_char_map_inv[v] = k
-end
-
-
-local function escape_char(c)
-  return "\\" .. (escape_char_map[c] or string.format("u%04x", c:byte()))
-end
-
-
-local function encode_nil(val)
-  return "null"
-end
-
-
-local function encode_table(val, stack, options, depth)
-  local res = {}
-  stack = stack or {}
-
-  -- Circular reference?
-  if stack[val] then error("circular reference") end
-
-  stack[val] = true
-
-  if rawget(val, 1) ~= nil and next(val) ~= nil then
-    -- Treat as array -- check keys are valid and it is not sparse
-    local n = 0
-    for k in pairs(val) do
-      if type(k) ~= "number" then
-        error("invalid table: mixed or invalid key types")
-      end
-      n = n + 1
-    end
-    if n ~= #val then
-      error("invalid table: sparse array")
-    end
-    -- Encode
-    for i, v in ipairs(val) do
-      if options.pretty then
-        table.insert(res, string.rep(options.indent, depth + 1) .. encode(v, stack, options, depth + 1))
-      else
-        table.insert(res, encode(v, stack, options, depth + 1))
-      end
-    end
-    stack[val] = nil
-    if options.pretty then
-      if #res == 0 then return "[]" end
-      return "[\n" ..
-          table.concat(res, ",\n") .. "\n" ..
-      string.rep(options.indent, depth) .. "]"
-    end
-    return "[" .. table.concat(res, ",") .. "]"
-  else
-    -- Treat as an object
-    for k, v in pairs(val) do
-      if type(k) ~= "string" then
-        error("invalid table: mixed or invalid key types")
-      end
-      if options.pretty then
-        table.insert(res, string.rep(options.indent, depth + 1) .. encode(k, stack, options, depth + 1) .. ": " .. encode(v, stack, options, depth + 1))
-      else
-        table.insert(res, encode(k, stack, options, depth + 1) .. ":" .. encode(v, stack, options, depth + 1))
-      end
-    end
-    stack[val] = nil
-    if options.pretty then
-      if #res == 0 then return "{}" end
-      table.sort(res)
-      return "{\n" ..
-        table.concat(res, ",\n") .. "\n" ..
-      string.rep(options.indent, depth) .. "}"
-    end
-    return "{" .. table.concat(res, ",") .. "}"
-  end
-end
-
-
-local function encode_string(val)
-  return '"' .. val:gsub('[%z\1-\31\\"]', escape_char) .. '"'
-end
-
-
-local function encode_number(val)
-  -- Check for NaN, -inf and inf
-  if val ~= val or val <= -math.huge or val >= math.huge then
-    error("unexpected number value '" .. tostring(val) .. "'")
-  end
-  return string.format("%.14g", val)
-end
-
-
-local type_func_map = {
-  [ "nil"     ] = encode_nil,
-  [ "table"   ] = encode_table,
-  [ "string"  ] = encode_string,
-  [ "number"  ] = encode_number,
-  [ "boolean" ] = tostring,
-}
-
-
-encode = function(val, stack, options, depth)
-  local t = type(val)
-  local f = type_func_map[t]
-  if f then
-    return f(val, stack, options, depth)
-  end
-  error("unexpected type '" .. t .. "'")
-end
-
-
-function json.encode(val, options)
-  if not options then options = {} end
-  if options.pretty and not options.indent then options.indent = "  " end
-  return encode(val, nil, options or {}, 0)
-end
-
-local parse
-
-local function create_set(...)
-  local res = {}
-  for i = 1, select("#", ...) do
-    res[ select(i, ...) ] = true
-  end
-  return res
-end
-
-local space_chars   = create_set(" ", "\t", "\r", "\n")
-local delim_chars   = create_set(" ", "\t", "\r", "\n", "]", "}", ",")
-local escape_chars  = create_set("\\", "/", '"', "b", "f", "n", "r", "t", "u")
-local literals      = create_set("true", "false", "null")
-
-local literal_map = {
-  [ "true"  ] = true,
-  [ "false" ] = false,
-  [ "null"  ] = nil,
-}
-
-
-local function next_char(str, idx, set, negate)
-  for i = idx, #str do
-    if set[str:sub(i, i)] ~= negate then
-      return i
-    end
-  end
-  return #str + 1
-end
-
-
-local function decode_error(str, idx, msg)
-  local line_count = 1
-  local col_count = 1
-  for i = 1, idx - 1 do
-    col_count = col_count + 1
-    if str:sub(i, i) == "\n" then
-      line_count = line_count + 1
-      col_count = 1
-    end
-  end
-  error( string.format("%s at line %d col %d", msg, line_count, col_count) )
-end
-
-
-local function codepoint_to_utf8(n)
-  -- http://scripts.sil.org/cms/scripts/page.php?site_id=nrsi&id=iws-appendixa
-  local f = math.floor
-  if n <= 0x7f then
-    return string.char(n)
-  elseif n <= 0x7ff then
-    return string.char(f(n / 64) + 192, n % 64 + 128)
-  elseif n <= 0xffff then
-    return string.char(f(n / 4096) + 224, f(n % 4096 / 64) + 128, n % 64 + 128)
-  elseif n <= 0x10ffff then
-    return string.char(f(n / 262144) + 240, f(n % 262144 / 4096) + 128,
-                       f(n % 4096 / 64) + 128, n % 64 + 128)
-  end
-  error( string.format("invalid unicode codepoint '%x'", n) )
-end
-
-
-local function parse_unicode_escape(s)
-  local n1 = tonumber( s:sub(1, 4),  16 )
-  local n2 = tonumber( s:sub(7, 10), 16 )
-   -- Surrogate pair?
-  if n2 then
-    return codepoint_to_utf8((n1 - 0xd800) * 0x400 + (n2 - 0xdc00) + 0x10000)
-  else
-    return codepoint_to_utf8(n1)
-  end
-end
-
-
-local function parse_string(str, i)
-  local res = ""
-  local j = i + 1
-  local k = j
-
-  while j <= #str do
-    local x = str:byte(j)
-
-    if x < 32 then
-      decode_error(str, j, "control character in string")
-
-    elseif x == 92 then -- `\`: Escape
-      res = res .. str:sub(k, j - 1)
-      j = j + 1
-      local c = str:sub(j, j)
-      if c == "u" then
-        local hex = str:match("^[dD][89aAbB]%x%x\\u%x%x%x%x", j + 1)
-                 or str:match("^%x%x%x%x", j + 1)
-                 or decode_error(str, j - 1, "invalid unicode escape in string")
-        res = res .. parse_unicode_escape(hex)
-        j = j + #hex
-      else
-        if not escape_chars[c] then
-          decode_error(str, j - 1, "invalid escape char '" .. c .. "' in string")
-        end
-        res = res .. escape_char_map_inv[c]
-      end
-      k = j + 1
-
-    elseif x == 34 then -- `"`: End of string
-      res = res .. str:sub(k, j - 1)
-      return res, j + 1
-    end
-
-    j = j + 1
-  end
-
-  decode_error(str, i, "expected closing quote for string")
-end
-
-
-local function parse_number(str, i)
-  local x = next_char(str, i, delim_chars)
-  local s = str:sub(i, x - 1)
-  local n = tonumber(s)
-  if not n then
-    decode_error(str, i, "invalid number '" .. s .. "'")
-  end
-  return n, x
-end
-
-
-local function parse_literal(str, i)
-  local x = next_char(str, i, delim_chars)
-  local word = str:sub(i, x - 1)
-  if not literals[word] then
-    decode_error(str, i, "invalid literal '" .. word .. "'")
-  end
-  return literal_map[word], x
-end
-
-
-local function parse_array(str, i)
-  local res = {}
-  local n = 1
-  i = i + 1
-  while 1 do
-    local x
-    i = next_char(str, i, space_chars, true)
-    -- Empty / end of array?
-    if str:sub(i, i) == "]" then
-      i = i + 1
-      break
-    end
-    -- Read token
-    x, i = parse(str, i)
-    res[n] = x
-    n = n + 1
-    -- Next token
-    i = next_char(str, i, space_chars, true)
-    local chr = str:sub(i, i)
-    i = i + 1
-    if chr == "]" then break end
-    if chr ~= "," then decode_error(str, i, "expected ']' or ','") end
-  end
-  return res, i
-end
-
-
-local function parse_object(str, i)
-  local res = {}
-  i = i + 1
-  while 1 do
-    local key, val
-    i = next_char(str, i, space_chars, true)
-    -- Empty / end of object?
-    if str:sub(i, i) == "}" then
-      i = i + 1
-      break
-    end
-    -- Read key
-    if str:sub(i, i) ~= '"' then
-      decode_error(str, i, "expected string for key")
-    end
-    key, i = parse(str, i)
-    -- Read ':' delimiter
-    i = next_char(str, i, space_chars, true)
-    if str:sub(i, i) ~= ":" then
-      decode_error(str, i, "expected ':' after key")
-    end
-    i = next_char(str, i + 1, space_chars, true)
-    -- Read value
-    val, i = parse(str, i)
-    -- Set
-    res[key] = val
-    -- Next token
-    i = next_char(str, i, space_chars, true)
-    local chr = str:sub(i, i)
-    i = i + 1
-    if chr == "}" then break end
-    if chr ~= "," then decode_error(str, i, "expected '}' or ','") end
-  end
-  return res, i
-end
-
-
-local char_func_map = {
-  [ '"' ] = parse_string,
-  [ "0" ] = parse_number,
-  [ "1" ] = parse_number,
-  [ "2" ] = parse_number,
-  [ "3" ] = parse_number,
-  [ "4" ] = parse_number,
-  [ "5" ] = parse_number,
-  [ "6" ] = parse_number,
-  [ "7" ] = parse_number,
-  [ "8" ] = parse_number,
-  [ "9" ] = parse_number,
-  [ "-" ] = parse_number,
-  [ "t" ] = parse_literal,
-  [ "f" ] = parse_literal,
-  [ "n" ] = parse_literal,
-  [ "[" ] = parse_array,
-  [ "{" ] = parse_object,
-}
-
-
-parse = function(str, idx)
-  local chr = str:sub(idx, idx)
-  local f = char_func_map[chr]
-  if f then
-    return f(str, idx)
-  end
-  decode_error(str, idx, "unexpected character '" .. chr .. "'")
-end
-
-
-function json.decode(str)
-  if type(str) ~= "string" then
-    error("expected argument of type string, got " .. type(str))
-  end
-  local res, idx = parse(str, next_char(str, 1, space_chars, true))
-  idx = next_char(str, idx, space_chars, true)
-  if idx <= #str then
-    decode_error(str, idx, "trailing garbage")
-  end
-  return res
-end
-
--- End JSON library.
-
+-- JSON is encoded and decoded natively; encode can stream its output straight into a file.
+global({ json = { encode = system.json_encode, decode = system.json_decode } })
 
 global({ common = {} })
 function common.merge(dst, src) for k, v in pairs(src) do dst[k] = v end return dst end
@@ -392,6 +18,25 @@ function common.slice(t, i, l) local n = {} for j = i, l ~= nil and (i - l) or #
 function common.join(j, l) local s = "" for i, v in ipairs(l) do if i > 1 then s = s .. j .. v else s = v end end return s end
 function common.sort(t, f) table.sort(t, f) return t end
 function common.write(path, contents) local f, err = io.open(path, "wb") if not f then error("can't write to " .. path .. ": " .. err) end f:write(contents) f:flush() f:close() end
+-- Streamed into path .. ".part", and renamed into place, so that a failure part way through never leaves path truncated.
+-- If path is a symlink, as dotfile managers like to make settings.json, it's whatever it links to that gets replaced.
+function common.write_json(path, value, options)
+  for i = 1, 32 do
+    local stat = system.stat_fast(path)
+    if not stat or not stat.symlink then break end
+    local absolute = stat.symlink:find("^[/\\]") or stat.symlink:find("^%a:")
+    path = (absolute or common.dirname(path) == path) and stat.symlink or (common.dirname(path) .. PATHSEP .. stat.symlink)
+  end
+  local f, err = io.open(path .. ".part", "wb")
+  if not f then error("can't write to " .. path .. ".part: " .. err) end
+  local status, err = pcall(json.encode, value, options, f)
+  f:close()
+  if not status then
+    os.remove(path .. ".part")
+    error(err, 0)
+  end
+  common.rename(path .. ".part", path)
+end
 function common.read(path) local f, err = io.open(path, "rb") if not f then error("can't read from " .. path .. ": " .. err) end local str = f:read("*all") f:close() return str end
 function common.uniq(l) local t = {} local k = {} for i,v in ipairs(l) do if not k[v] then table.insert(t, v) k[v] = true end end return t end
 function common.delete(h, d) local t = {} for k,v in pairs(h) do if k ~= d then t[k] = v end end return t end
@@ -417,50 +62,15 @@ function common.handleize(str) return str:lower():gsub("[^a-z0-9%-_]+", "-"):gsu
 function common.is_commit_hash(hash) return #hash == 40 and not hash:find("[^a-f0-9]") end
 function common.dirname(path) local s = path:reverse():find("[/\\]") if not s then return path end return path:sub(1, #path - s) end
 function common.basename(path) local s = path:reverse():find("[/\\]") if not s then return path end return path:sub(#path - s + 2) end
-function common.exists(path) return path and system.stat(path) and path end
+function common.exists(path) return path and system.exists(path) and path end
 function common.path(exec)
   -- On windows, in theory to resolve things, we also check the working directory even without a PATHSEP.
-  if exec:find(PATHSEP) or PLATFORM == "windows" and system.stat(exec) then return exec end
+  if exec:find(PATHSEP) or PLATFORM == "windows" and system.exists(exec) then return exec end
   return common.first(common.map({ common.split(":", os.getenv("PATH")) }, function(e) return e .. PATHSEP .. exec end), function(e) local s = system.stat(e) return s and s.type ~= "dir" and s.mode and s.mode & 73 and (not s.symlink or system.stat(s.symlink)) end)
 end
 function common.normalize_path(path) if PLATFORM == "windows" and path then path = path:gsub("/", PATHSEP) end if not path or not path:find("^~") then return path end return os.getenv("HOME") .. path:sub(2) end
-function common.rmrf(root)
-  local info = root and root ~= "" and system.stat(root)
-  if not info then return end
-  if info.type == "file" or info.symlink then
-    if PLATFORM == "windows" and info.symlink and info.type == "dir" then
-      system.rmdir(root)
-    else
-      local status, err = os.remove(root)
-      if not status then
-        if not err:find("denied") then error("can't remove " .. root .. ": " .. err) end
-        system.chmod(root, 448) -- chmod so that we can write, for windows.
-        status, err = os.remove(root)
-        if not status then error("can't remove " .. root .. ": " .. err) end
-      end
-    end
-  else
-    for i,v in ipairs(system.ls(root)) do common.rmrf(root .. PATHSEP .. v) end
-    system.rmdir(root)
-  end
-end
-function common.mkdirp(path)
-  local stat = system.stat(path)
-  if stat and stat.type == "dir" then return true end
-  if stat and stat.type == "file" then error("path " .. path .. " exists") end
-  local segments = { common.split("[/\\]", path) }
-  local target
-  local extant_root = 0
-  for i, dirname in ipairs(segments) do -- we need to do this, incase directories earlier in the chain exist, but we don't have permission to read.
-    target = target and target .. PATHSEP .. dirname or dirname
-    if system.stat(target) then extant_root = i end
-  end
-  target = nil
-  for i, dirname in ipairs(segments) do
-    target = target and target .. PATHSEP .. dirname or dirname
-    if i >= extant_root and target ~= "" and not target:find("^[A-Z]:$") and not system.stat(target) then system.mkdir(target) end
-  end
-end
+function common.rmrf(root) if root and root ~= "" then system.rmrf(root) end end
+function common.mkdirp(path) system.mkdirp(path) end
 local DID_WARN_SYMLINK = false
 
 function common.symlink(src, dst)
@@ -476,36 +86,57 @@ function common.symlink(src, dst)
   error(result)
 end
 
-function common.copy(src, dst, hidden, symlink)
+-- If store is specified, files are hardlinked from that content-addressed store, rather than copied.
+function common.copy(src, dst, hidden, symlink, store)
   local src_stat, dst_stat = system.stat(src), system.stat(dst)
   if not src_stat then error("can't find " .. src) end
   if not hidden and common.basename(src):find("^%.") then return end
-  if dst_stat and dst_stat.type == "dir" then return common.copy(src, dst .. PATHSEP .. common.basename(src), hidden, symlink) end
+  if dst_stat and dst_stat.type == "dir" then return common.copy(src, dst .. PATHSEP .. common.basename(src), hidden, symlink, store) end
   if src_stat.type == "dir" then
     common.mkdirp(dst)
-    for i, file in ipairs(system.ls(src)) do common.copy(src .. PATHSEP .. file, dst .. PATHSEP .. file, hidden, symlink) end
-  elseif not symlink then
-    local src_io, err1 = io.open(src, "rb")
-    if err1 then error("can't open for reading " .. src .. ": " .. err1) end
-    local dst_io, err2 = io.open(dst, "wb")
-    if err2 then error("can't open for writing " .. dst .. ": " .. err2) end
-    while true do
-      local chunk = src_io:read(64*1024)
-      if not chunk then break end
-      dst_io:write(chunk)
-    end
-    dst_io:close()
-    src_io:close()
-    system.chmod(dst, src_stat.mode)
-  else
+    if not symlink and not store then return system.copy_tree(src, dst, { hidden = hidden }) end
+    for i, file in ipairs(system.ls(src)) do common.copy(src .. PATHSEP .. file, dst .. PATHSEP .. file, hidden, symlink, store) end
+  elseif symlink then
     common.symlink(src, dst)
+  elseif store then
+    system.store(src, dst, store)
+  else
+    system.copy_tree(src, dst)
   end
 end
+-- Replaces anything at dst with src; in one atomic swap where the platform supports it.
 function common.rename(src, dst)
-  if not os.rename(src, dst) then
-    common.copy(src, dst)
-    common.rmrf(src)
-  end
+  -- What moves is src's directory entry, so it's src's parent that says which device it's on; src itself may be a
+  -- symlink to somewhere else entirely.
+  local src_stat, src_parent, parent = system.stat_fast(src), common.dirname(src), common.dirname(dst)
+  local src_device = src_stat and system.stat(src_parent ~= src and src_parent or ".", "device")
+  -- dst's parent has to exist for us to know which device it's on, and it'll have to exist anyway.
+  if parent ~= dst then common.mkdirp(parent) else parent = "." end
+  if src_device and src_device ~= system.stat(parent, "device") then
+    -- Across devices, copy next to dst first, so that dst is still replaced in a single step.
+    local staging = dst .. ".lpm-staging"
+    common.rmrf(staging)
+    if src_stat.symlink then common.symlink(src_stat.symlink, staging) else common.copy(src, staging, true) end
+    common.rename(staging, dst)
+    return common.rmrf(src)
+  end
+  if system.exists(dst) then
+    local exchanged, err = system.rename(src, dst, true)
+    if exchanged then return common.rmrf(src) end
+    if VERBOSE then log.action("Can't atomically replace " .. dst .. " (" .. err .. "); removing it first") end
+    common.rmrf(dst)
+  end
+  local status, err = system.rename(src, dst)
+  if not status then error("can't rename " .. err) end
+end
+-- Returns the directory to stage things bound for root in; TMPDIR, unless that's on another device, as then moving
+-- them into place would mean copying them.
+function common.staging_dir(root)
+  local function device(path)
+    while not system.exists(path) and common.dirname(path) ~= path do path = common.dirname(path) end
+    return system.stat(path, "device")
+  end
+  return device(root) == device(TMPDIR) and TMPDIR or (root .. PATHSEP .. ".lpm-tmp")
 end
 function common.reset(path, ref, type)
   if common.is_commit_hash(ref) then
@@ -571,7 +202,7 @@ global({
 })
 global({ 
   "HOME", "USERDIR", "CACHEDIR", "CONFIGDIR", "BOTTLEDIR", "JSON", "TABLE", "HEADER", "RAW", "VERBOSE", "FILTRATION", "UPDATE", "MOD_VERSION", "QUIET", "FORCE", "REINSTALL", "CONFIG",
-  "NO_COLOR", "AUTO_PULL_REMOTES", "ARCH", "ASSUME_YES", "NO_INSTALL_OPTIONAL", "TMPDIR", "DATADIR", "BINARY", "POST", "PROGRESS", "SYMLINK", "REPOSITORY", "EPHEMERAL",
+  "NO_COLOR", "AUTO_PULL_REMOTES", "ARCH", "ASSUME_YES", "NO_INSTALL_OPTIONAL", "TMPDIR", "DATADIR", "BINARY", "POST", "PROGRESS", "SYMLINK", "STORE", "STAGING", "REPOSITORY", "EPHEMERAL",
   "MASK", "settings", "repositories", "lite_xls", "system_bottle", "primary_lite_xl", "progress_bar_label", "write_progress_bar" 
 })
 global({ Addon = {}, Repository = {}, LiteXL = {}, Bottle = {}, lpm = {}, log = {} })
@@ -586,9 +217,9 @@ local CORE_PLUGINS = {
 }
 
 local function engage_locks(func, err, warn)
-  if not system.stat(CACHEDIR) then common.mkdirp(CACHEDIR) end
+  if not system.exists(CACHEDIR) then common.mkdirp(CACHEDIR) end
   local lockfile = CACHEDIR .. PATHSEP .. ".lock"
-  if not system.stat(lockfile) then common.write(lockfile, "") end
+  if not system.exists(lockfile) then common.write(lockfile, "") end
   return system.flock(lockfile, func, err, warn)
 end
 
@@ -669,10 +300,10 @@ function common.request(method, source, options)
     return res, headers
   end
   local cache_dir = checksum == "SKIP" and TMPDIR or (options.cache or CACHEDIR)
-  if not system.stat(cache_dir .. PATHSEP .. "files") then common.mkdirp(cache_dir .. PATHSEP .. "files") end
+  if not system.exists(cache_dir .. PATHSEP .. "files") then common.mkdirp(cache_dir .. PATHSEP .. "files") end
   local cache_path = cache_dir .. PATHSEP .. "files" .. PATHSEP .. system.hash(checksum .. options.depth[1])
-  if checksum ~= "SKIP" and system.stat(cache_path) and system.hash(cache_path, "file") ~= checksum then common.rmrf(cache_path) end
-  if not system.stat(cache_path) then
+  if checksum ~= "SKIP" and system.exists(cache_path) and system.hash(cache_path, "file") ~= checksum then common.rmrf(cache_path) end
+  if not system.exists(cache_path) then
     res, headers = system.request(method, protocol, hostname, port, rest, cache_path .. ".part", callback, proxy_host, proxy_port)
     if headers.location then return common.request(method, headers.location, common.merge(options, {  })) end
     if checksum ~= "SKIP" and system.hash(cache_path .. ".part", "file") ~= checksum then
@@ -691,41 +322,45 @@ function common.head(source, options) return select(2, common.request("HEAD", so
 
 -- Determines whether two addons located at different paths are actually different based on their contents.
 -- If path1 is a directory, will still return true if it's a subset of path2 (accounting for binary downloads).
-function common.is_path_different(path1, path2)
-  local stat1, stat2 = system.stat(path1), system.stat(path2)
-  if not stat1 or not stat2 or stat1.type ~= stat2.type or (stat1 == "file" and stat1.size ~= stat2.size) then return true end
-  if stat1.type == "dir" then
-    for i, file in ipairs(system.ls(path1)) do
-      if not common.basename(file):find("^%.") and common.is_path_different(path1 .. PATHSEP .. file, path2 .. PATHSEP.. file) then return true end
-    end
-    return false
-  end
-  return system.hash(path1, "file") ~= system.hash(path2, "file")
-end
+function common.is_path_different(path1, path2) return (system.tree_diff(path1, path2)) end
 
 
 
+-- Versions and version patterns are parsed once, then remembered; the same few hundred strings get compared constantly.
+local parsed_versions, parsed_patterns = {}, {}
+local function parse_version(version)
+  local parsed = parsed_versions[version]
+  if not parsed then
+    local _, _, major, minor, revision = tostring(version):find("(%d+)%.?(%d*)%.?(%d*)")
+    if major == nil then error("can't parse version " .. version) end
+    parsed = { tonumber(major) or 0, tonumber(minor) or 0, tonumber(revision) or 0 }
+    parsed_versions[version] = parsed
+  end
+  return parsed
+end
+
 local function compare_version(a, b) -- compares semver
   if not a or not b then return false end
-  local _, _, majora, minora, revisiona = tostring(a):find("(%d+)%.?(%d*)%.?(%d*)")
-  local _, _, majorb, minorb, revisionb = tostring(b):find("(%d+)%.?(%d*)%.?(%d*)")
-  if majora == nil then error("can't parse version " .. a) end
-  if majorb == nil then error("can't parse version " .. b) end
-  majora, minora, revisiona = tonumber(majora) or 0, tonumber(minora) or 0, tonumber(revisiona) or 0
-  majorb, minorb, revisionb = tonumber(majorb) or 0, tonumber(minorb) or 0, tonumber(revisionb) or 0
-  if majora ~= majorb then return majora < majorb and -3 or 3 end
-  if minora ~= minorb then return minora < minorb and -2 or 2 end
-  if revisiona ~= revisionb then return revisiona < revisionb and -1 or 1 end
+  a, b = parse_version(a), parse_version(b)
+  if a[1] ~= b[1] then return a[1] < b[1] and -3 or 3 end
+  if a[2] ~= b[2] then return a[2] < b[2] and -2 or 2 end
+  if a[3] ~= b[3] then return a[3] < b[3] and -1 or 1 end
   return 0
 end
 
 local function match_version(version, pattern)
   if not pattern then return true end
-  if pattern:find("^>=") then return compare_version(version, pattern:sub(3)) >= 0 end
-  if pattern:find("^<=") then return compare_version(version, pattern:sub(3)) <= 0 end
-  if pattern:find("^<") then return compare_version(version, pattern:sub(2)) == -1 end
-  if pattern:find("^>") then return compare_version(version, pattern:sub(2)) == 1 end
-  if pattern:find("^=") then return compare_version(version, pattern:sub(2)) == 0 end
+  local parsed = parsed_patterns[pattern]
+  if not parsed then
+    parsed = { pattern:match("^([<>]?=?)(.*)$") }
+    parsed_patterns[pattern] = parsed
+  end
+  local operator, operand = parsed[1], parsed[2]
+  if operator == ">=" then return compare_version(version, operand) >= 0 end
+  if operator == "<=" then return compare_version(version, operand) <= 0 end
+  if operator == "<" then return compare_version(version, operand) == -1 end
+  if operator == ">" then return compare_version(version, operand) == 1 end
+  if operator == "=" then return compare_version(version, operand) == 0 end
   return version == pattern
 end
 
@@ -744,8 +379,12 @@ end
 -- bundled: Addon is part of the lite data directory, but has corresponding addons in any repository.
 -- incompatible: Addon is not installed and conflicts with existing installed addons.
 function Addon.__index(self, idx) return rawget(self, idx) or Addon[idx] end
-function Addon.new(repository, metadata)
+function Addon.check_id(metadata)
   if type(metadata.id) ~= 'string' or metadata.id:find("[^a-z0-9%-_]") then error("addon requires a valid id " .. (metadata.id and "(" .. metadata.id .. " is invalid)" or "")) end
+end
+
+function Addon.new(repository, metadata)
+  Addon.check_id(metadata)
   local type = metadata.type or "plugin"
   if metadata.type ~= "meta" and not metadata.path and not metadata.files and not metadata.url and not metadata.remote then metadata.path = "." end
   if metadata.path then metadata.path = metadata.path:gsub("/", PATHSEP) end
@@ -762,10 +401,12 @@ function Addon.new(repository, metadata)
     name = metadata.id
   }, metadata), Addon)
   self.type = type
+  -- Manifests sometimes give versions as numbers. Made strings here, so they survive the manifest index; 1.0 would come back as 1.
+  if math.type(self.version) then self.version = tostring(self.version) end
   -- Directory.
   local plural_type = type == "library" and "libraries" or (type .. "s")
-  if not self.path and repository and repository.local_path and system.stat(repository.local_path .. PATHSEP .. plural_type  .. PATHSEP .. self.id .. ".lua") then self.path = plural_type .. PATHSEP .. self.id .. ".lua" end
-  if not self.path and repository and repository.local_path and system.stat(repository.local_path .. PATHSEP .. plural_type .. PATHSEP .. self.id) then self.path = plural_type .. PATHSEP .. self.id end
+  if not self.path and repository and repository.local_path and system.exists(repository.local_path .. PATHSEP .. plural_type  .. PATHSEP .. self.id .. ".lua") then self.path = plural_type .. PATHSEP .. self.id .. ".lua" end
+  if not self.path and repository and repository.local_path and system.exists(repository.local_path .. PATHSEP .. plural_type .. PATHSEP .. self.id) then self.path = plural_type .. PATHSEP .. self.id end
 
   if self.dependencies and #self.dependencies > 0 then
     local t = {}
@@ -776,12 +417,12 @@ function Addon.new(repository, metadata)
     if self.remote then
       local repo = Repository.url(self.remote)
       local local_path = repo.local_path and (repo.local_path .. (self.path and (PATHSEP .. self.path:gsub("^/", ""):gsub("%.$", "")) or ""))
-      self.local_path = local_path and system.stat(local_path) and local_path or nil
+      self.local_path = local_path and system.exists(local_path) and local_path or nil
     else
       self.local_path = (repository.local_path .. (self.path and (PATHSEP .. self.path:gsub("^/", ""):gsub("%.$", "")) or "")) or nil
     end
   end
-  self.organization = metadata.organization or (((self.files and #self.files > 0) or (not self.url and (not self.path or not (self.local_path and (system.stat(self.local_path) or {}).type == "file")))) and "complex" or "singleton")
+  self.organization = metadata.organization or (((self.files and #self.files > 0) or (not self.url and (not self.path or not (self.local_path and system.type(self.local_path) == "file")))) and "complex" or "singleton")
   return self
 end
 
@@ -792,15 +433,13 @@ end
 function Addon:is_stub() return self.remote end
 function Addon:is_asset() return self.type == "font" end
 
-function Addon:unstub()
+function Addon:unstub(repo)
   if not self:is_stub() or self.inaccessible then return end
-  local repo
   local status, err = pcall(function()
-    repo = Repository.url(self.remote):fetch_if_not_present()
-    local manifest = repo:parse_manifest(self.id)
-    local remote_entry = common.grep(manifest['addons'] or manifest['plugins'], function(e) return e.id == self.id end)[1]
-    if not remote_entry then error("can't find " .. self.type .. " " .. self.id .. " on " .. self.remote) end
-    local addon = Addon.new(repo, remote_entry)
+    repo = (repo or Repository.url(self.remote)):fetch_if_not_present()
+    repo:parse_manifest(self.id)
+    local addon = common.grep(repo:get_addons(self.id), function(e) return e.id == self.id end)[1]
+    if not addon then error("can't find " .. self.type .. " " .. self.id .. " on " .. self.remote) end
 
     -- merge in attribtues that are probably more accurate than the stub
     if addon.version ~= self.version then log.warning(self.id .. " stub on " .. self.repository:url() .. " has differing version from remote (" .. self.version .. " vs " .. addon.version .. "); may lead to install being inconsistent") end
@@ -811,6 +450,60 @@ function Addon:unstub()
   return repo
 end
 
+-- Runs each task in its own coroutine, with at most `workers` of them running at once. Native fetches yield back here
+-- while their transfer runs on a background thread, so tasks that fetch proceed concurrently.
+local function run_concurrently(tasks, workers)
+  local running, next_task = {}, 1
+  while next_task <= #tasks or #running > 0 do
+    while #running < workers and next_task <= #tasks do
+      table.insert(running, coroutine.create(tasks[next_task]))
+      next_task = next_task + 1
+    end
+    local finished = false
+    for i = #running, 1, -1 do
+      local status, err = coroutine.resume(running[i])
+      if not status then error(err, 0) end
+      if coroutine.status(running[i]) == "dead" then table.remove(running, i) finished = true end
+    end
+    if not finished and #running > 0 then system.sleep(0.01) end
+  end
+end
+
+-- Unstubs a number of addons at once; every remote they point at is fetched first, a few at a time, then each
+-- stub is merged as in Addon:unstub.
+local MAX_FETCH_WORKERS = 8
+function Addon.unstub_all(addons)
+  local stubs = common.grep(addons, function(addon) return addon:is_stub() and not addon.inaccessible end)
+  local repos, tasks = {}, {}
+  for _, addon in ipairs(stubs) do
+    if not repos[addon.remote] then
+      local status, repo = pcall(Repository.url, addon.remote)
+      repos[addon.remote] = { repo = status and repo, err = not status and repo or nil }
+      if status then
+        table.insert(tasks, function()
+          local status, err = pcall(repo.fetch_if_not_present, repo)
+          if not status then repos[addon.remote].err = err end
+        end)
+      end
+    end
+  end
+  if #tasks > 1 then
+    -- progress bars from concurrent fetches would only trample each other; just log what's being fetched
+    local progress_bar = write_progress_bar
+    write_progress_bar = nil
+    local status, err = pcall(run_concurrently, tasks, MAX_FETCH_WORKERS)
+    write_progress_bar = progress_bar
+    if not status then error(err, 0) end
+  elseif #tasks == 1 then
+    tasks[1]()
+  end
+  for _, addon in ipairs(stubs) do
+    local fetched = repos[addon.remote]
+    if fetched.err then addon.inaccessible = fetched.err else addon:unstub(fetched.repo) end
+  end
+  return stubs
+end
+
 function Addon.is_addon_different(downloaded_path, installed_path)
   local is_downloaded_single = downloaded_path:find("%.lua$")
   local is_installed_single = installed_path:find("%.lua$")
@@ -836,7 +529,13 @@ end
 function Addon:is_orphan(bottle) return not self.repository end
 function Addon:is_core(bottle) return self.location == "core" end
 function Addon:is_bundled(bottle) return self.location == "bundled" end
+-- Installed status is remembered per bottle, until something is installed or uninstalled; see Bottle:invalidate_cache.
 function Addon:is_installed(bottle)
+  if not bottle.installed_cache then bottle.installed_cache = setmetatable({}, { __mode = "k" }) end
+  if bottle.installed_cache[self] == nil then bottle.installed_cache[self] = self:detect_installed(bottle) and true or false end
+  return bottle.installed_cache[self]
+end
+function Addon:detect_installed(bottle)
   if self:is_core(bottle) or self:is_bundled(bottle) or not self.repository then return true end
   if self.type == "meta" then
     if self:is_explicitly_installed(bottle) then return true end
@@ -848,11 +547,11 @@ function Addon:is_installed(bottle)
     return true
   end
   local install_path = self:get_install_path(bottle)
-  if not system.stat(install_path) then return false end
+  if not system.exists(install_path) then return false end
   if self:is_asset() then return true end
   local installed_addons = common.grep({ bottle:get_addon(self.id, nil, {  }) }, function(addon) return not addon.repository end)
   if #installed_addons > 0 then return false end
-  return self.local_path and not Addon.is_addon_different(self.local_path, install_path)
+  return self.local_path and not bottle:is_addon_different(self.local_path, install_path)
 end
 function Addon:is_upgradable(bottle)
   if self:is_installed(bottle) then
@@ -871,74 +570,77 @@ function Addon:is_incompatible(addon)
     (self.conflicts[addon.id] and match_version(addon.version, self.conflicts[addon.id] and self.conflicts[addon.id].version))
 end
 
+-- Mirrors the arch check at the end of Addon:install.
+function Addon:supports_arch()
+  if #common.grep(self.files or {}, function(e) return e.arch and not e.optional end) == 0 then return true end
+  for _, arch in ipairs(ARCH) do
+    local has_one_file = common.first(self.files, function(file)
+      return file.arch and #common.grep(type(file.arch) == "string" and { file.arch } or file.arch, function(e) return e == arch end) > 0
+    end)
+    if not has_one_file and (not self.arch or (self.arch ~= "*" and #common.grep(self.arch, function(a) return a == arch end) == 0)) then return false, arch end
+  end
+  return true
+end
+
 function Addon:get_path(bottle)
   return self:is_installed(bottle) and self:get_install_path(bottle) or self.local_path
 end
 
+-- Picks an addon for each of this addon's dependencies, consistent with each other and with what's installed; see
+-- Bottle:resolve. Optional dependencies are only picked if they fit in with everything else.
 function Addon:get_compatibilities(bottle)
   local dependency_list = common.canonical_order(self.dependencies)
-  if #dependency_list == 0 then return {}, {} end 
-  local compatible_addons, incompatible_addons = {}, {}
-  local installed_addons = bottle:installed_addons()
-  for _, addon in ipairs(dependency_list) do
-    local v = self.dependencies[addon]
-    local potential_addons = { bottle:get_addon(addon, v.version, MOD_VERSION ~= "any" and { mod_version = bottle.lite_xl.mod_version }) }
-    for i, potential_addon in ipairs(potential_addons) do
-      local incomaptibilities = common.grep(installed_addons, function(p) return p:is_incompatible(potential_addon) end)
-      if #incomaptibilities == 0 then
-        if not compatible_addons[addon] or
-          potential_addon:is_installed(bottle) or
-          (compare_version(compatible_addons[addon].version, potential_addon.version) and not compatible_addons[addon]:is_installed(bottle))
-        then
-          if not compatible_addons[addon] or not potential_addon:is_stub() then
-            compatible_addons[addon] = potential_addon
-          end
-        end
-      else
-        incompatible_addons[addon] = incompatibilities
+  if #dependency_list == 0 then return {} end
+  local plan, chosen = bottle:resolve({ { self } })
+  if not plan then return nil, chosen end
+  local compatible_addons = {}
+  for _, id in ipairs(dependency_list) do
+    local v = self.dependencies[id]
+    if not v.optional then
+      compatible_addons[id] = chosen[id]
+    else
+      local candidates = { bottle:get_addon(id, v.version, MOD_VERSION ~= "any" and { mod_version = bottle.lite_xl.mod_version }) }
+      if #candidates > 0 then
+        local optional_plan, optional_chosen = bottle:resolve({ { self }, candidates })
+        if optional_plan then compatible_addons[id] = optional_chosen[candidates[1].id] end
       end
     end
   end
-  return compatible_addons, incompatible_addons
+  return compatible_addons
 end
 
 
-
-function Addon:install(bottle, installing)
+-- If resolved, this addon's dependencies have already been worked out and installed, as they are by Bottle:apply.
+function Addon:install(bottle, installing, resolved)
   if MASK[self.id] then if not installing[self.id] then log.warning("won't install masked addon " .. self.id) end installing[self.id] = true return end
   if self:is_installed(bottle) and not REINSTALL then error("addon " .. self.id .. " is already installed") return end
   if self:is_stub() then self:unstub() end
   if self.inaccessible then error("addon " .. self.id .. " is inaccessible: " .. self.inaccessible) end
   local install_path = self:get_install_path(bottle)
-  if install_path:find(USERDIR, 1, true) ~= 1 and install_path:find(TMPDIR, 1, true) ~= 1 then error("invalid install path: " .. install_path) end
-  local temporary_install_path = TMPDIR .. PATHSEP .. install_path:sub(((install_path:find(TMPDIR, 1, true) == 1) and #TMPDIR or #USERDIR) + 2)
+  local in_staging = install_path:find(TMPDIR, 1, true) == 1 or install_path:find(STAGING[BOTTLEDIR], 1, true) == 1
+  if install_path:find(USERDIR, 1, true) ~= 1 and not in_staging then error("invalid install path: " .. install_path) end
+  local temporary_install_path = in_staging and install_path or (STAGING[USERDIR] .. PATHSEP .. install_path:sub(#USERDIR + 2))
   
   local status, err = pcall(function()
     installing = installing or {}
     installing[self.id] = true
-    local compatible, incompatible = self:get_compatibilities(bottle)
-    local dependency_list = common.canonical_order(self.dependencies)
-    for _, addon in ipairs(dependency_list) do
-      if incompatible[addon] then error("can't install " .. self.id .. ": incompatible with " .. incompatible[addon][1].id .. ":" .. incompatible[addon][1].version) end
-    end
-    for _, addon in ipairs(dependency_list) do
-      local v = self.dependencies[addon]
-      if not compatible[addon] then
-        if not v.optional then
-          error("can't find dependency " .. addon .. (v.version and (":" .. v.version) or ""))
-        else
-          log.warning("can't find optional dependency " .. addon .. (v.version and (":" .. v.version) or ""))
-        end
+    if not resolved then
+      local compatible, err = self:get_compatibilities(bottle)
+      if not compatible then error("can't install " .. self.id .. ": " .. err) end
+      local dependency_list = common.canonical_order(self.dependencies)
+      for _, addon in ipairs(dependency_list) do
+        local v = self.dependencies[addon]
+        if not compatible[addon] then log.warning("can't find optional dependency " .. addon .. (v.version and (":" .. v.version) or "")) end
       end
-    end
-    for _, addon in ipairs(dependency_list) do
-      local v = self.dependencies[addon]
-      if compatible[addon] and not compatible[addon]:is_core(bottle) and not compatible[addon]:is_installed(bottle) then
-        if installing[addon] then
-          error("circular dependency detected in " .. self.id .. ": requires " .. addon .. " but, " .. addon .. " requires " .. self.id)
-        end
-        if not v.optional or (not NO_INSTALL_OPTIONAL and prompt(addon .. " is an optional dependency of " .. self.id .. ". Should we install it?")) then
-          compatible[addon]:install(bottle, installing)
+      for _, addon in ipairs(dependency_list) do
+        local v = self.dependencies[addon]
+        if compatible[addon] and not compatible[addon]:is_core(bottle) and not compatible[addon]:is_installed(bottle) then
+          if installing[addon] then
+            error("circular dependency detected in " .. self.id .. ": requires " .. addon .. " but, " .. addon .. " requires " .. self.id)
+          end
+          if not v.optional or (not NO_INSTALL_OPTIONAL and prompt(addon .. " is an optional dependency of " .. self.id .. ". Should we install it?")) then
+            compatible[addon]:install(bottle, installing)
+          end
         end
       end
     end
@@ -957,11 +659,11 @@ function Addon:install(bottle, installing)
     end
     if self.organization == "complex" and self.path and common.stat(self.local_path).type ~= "dir" then common.mkdirp(install_path) end
     if self.url then -- remote simple addon
-      local path = temporary_install_path .. (self.organization == 'complex' and self.path and system.stat(self.local_path).type ~= "dir" and (PATHSEP .. "init.lua") or "")
+      local path = temporary_install_path .. (self.organization == 'complex' and self.path and system.type(self.local_path) ~= "dir" and (PATHSEP .. "init.lua") or "")
       common.get(self.url, { target = path, checksum = self.checksum, callback = write_progress_bar })
       if VERBOSE then log.action("Downloaded file " .. self.url .. " to " .. path) end
     else -- local addon that has a local path
-      local temporary_path = temporary_install_path .. (self.organization == 'complex' and self.path and system.stat(self.local_path).type ~= "dir" and (PATHSEP .. "init.lua") or "")
+      local temporary_path = temporary_install_path .. (self.organization == 'complex' and self.path and system.type(self.local_path) ~= "dir" and (PATHSEP .. "init.lua") or "")
       if self.organization == 'complex' and self.path and common.stat(self.local_path).type ~= "dir" then common.mkdirp(temporary_install_path) end
       if self.path then
         local path = install_path .. (self.organization == 'complex' and self.path and common.stat(self.local_path).type ~= "dir" and (PATHSEP .. "init.lua") or "")
@@ -970,7 +672,7 @@ function Addon:install(bottle, installing)
         else
           if VERBOSE then log.action("Copying " .. self.local_path .. " to " .. path .. ".") end
         end
-        common.copy(self.local_path, temporary_path, false, SYMLINK)
+        common.copy(self.local_path, temporary_path, false, SYMLINK, STORE)
       end
     end
 
@@ -990,12 +692,12 @@ function Addon:install(bottle, installing)
             local local_path = self.repository.repo_path .. PATHSEP .. (file.path or common.basename(file.url))
             local stripped_local_path = local_path:find("%.[^%.]+%-[^%.]+%.[^%.]*$") and local_path:gsub("%.[^%.]+%-[^%.]+", "") or local_path
 
-            if not system.stat(temporary_path) then
+            if not system.exists(temporary_path) then
               common.mkdirp(common.dirname(temporary_path))
-              if SYMLINK and self.repository:is_local() and system.stat(local_path) then
+              if SYMLINK and self.repository:is_local() and system.exists(local_path) then
                 log.action("Symlinking " .. local_path .. " to " .. target_path .. ".")
                 common.symlink(local_path, temporary_path)
-              elseif SYMLINK and self.repository:is_local() and system.stat(stripped_local_path) then
+              elseif SYMLINK and self.repository:is_local() and system.exists(stripped_local_path) then
                 log.action("Symlinking " .. stripped_local_path .. " to " .. target_path .. ".")
                 common.symlink(stripped_local_path, temporary_path)
               else
@@ -1015,10 +717,10 @@ function Addon:install(bottle, installing)
                 for _, executable in ipairs(file.extra.chmod_executable) do
                   local path = common.dirname(temporary_path) .. PATHSEP .. executable:gsub("/", PATHSEP):gsub("^" .. PATHSEP, "")
                   if path:find(PATHSEP .. "%.%.") then error("invalid chmod_executable value " .. executable) end
-                  local stat = system.stat(path)
-                  if not stat then error("can't find executable to chmod_executable " .. path) end
+                  local mode = system.stat(path, "mode")
+                  if not mode then error("can't find executable to chmod_executable " .. path) end
                   if VERBOSE then log.action("Chmodding file " .. executable .. " to be executable.") end
-                  system.chmod(path, stat.mode | 73)
+                  system.chmod(path, mode | 73)
                 end
               end
             end
@@ -1031,7 +733,7 @@ function Addon:install(bottle, installing)
       end
     end
   end)
-  bottle:invalidate_cache()
+  bottle:invalidate_cache(self)
   if not status then
     common.rmrf(temporary_install_path)
     error(err, 0)
@@ -1046,7 +748,6 @@ function Addon:install(bottle, installing)
       end)
     end
     if install_path ~= temporary_install_path then
-      common.rmrf(install_path)
       common.mkdirp(common.dirname(install_path))
       common.rename(temporary_install_path, install_path)
     end
@@ -1115,6 +816,7 @@ function Addon:uninstall(bottle, uninstalling)
       if not addon:uninstall(bottle, common.merge(uninstalling or {}, { [self.id] = true })) then return false end
     end
     common.rmrf(install_path)
+    bottle:invalidate_cache(self)
     return true
   end
   return false
@@ -1124,7 +826,7 @@ end
 function Repository.__index(self, idx) return rawget(self, idx) or Repository[idx] end
 function Repository.new(hash)
   if hash.remote then
-    if not hash.remote:find("^%w+:") and system.stat(hash.remote .. "/.git") then hash.remote = "file://" .. system.stat(hash.remote).abs_path end
+    if not hash.remote:find("^%w+:") and system.exists(hash.remote .. "/.git") then hash.remote = "file://" .. system.stat(hash.remote).abs_path end
     if not hash.remote:find("^https?:") and not hash.remote:find("^file:") then error("only repositories with http and file transports are supported (" .. hash.remote .. ")") end
   else
     if not hash.repo_path then error("requires a remote, or a repo_path") end
@@ -1140,11 +842,11 @@ function Repository.new(hash)
     last_retrieval = nil
   }, Repository)
   if not self:is_local() then
-    if system.stat(self.repo_path) and not self.commit and not self.branch then
+    if system.exists(self.repo_path) and not self.commit and not self.branch then
       -- In the case where we don't have a branch, and don't have a commit, check for the presence of `master` and `main`.
-      if system.stat(self.repo_path .. PATHSEP .. "master") then
+      if system.exists(self.repo_path .. PATHSEP .. "master") then
         self.branch = "master"
-      elseif system.stat(self.repo_path .. PATHSEP .. "main") then
+      elseif system.exists(self.repo_path .. PATHSEP .. "main") then
         self.branch = "main"
       else
         error("can't find branch for " .. self.remote .. " in " .. self.repo_path)
@@ -1187,38 +889,120 @@ function Repository.get_or_create(url)
   end)[0] or repo
 end
 
+-- Reads the commit the repository has checked out straight from .git; quicker than having libgit2 open it.
+function Repository:get_head()
+  local git = self.local_path .. PATHSEP .. ".git" .. PATHSEP
+  local head = system.exists(git .. "HEAD") and common.read(git .. "HEAD"):match("^%s*(.-)%s*$")
+  local ref = head and head:match("^ref:%s*(%S+)")
+  if ref and system.exists(git .. ref:gsub("/", PATHSEP)) then
+    head = common.read(git .. ref:gsub("/", PATHSEP)):match("%x+")
+  elseif ref and system.exists(git .. "packed-refs") then
+    head = common.read(git .. "packed-refs"):match("(%x+) " .. ref:gsub("%p", "%%%0") .. "\n")
+  end
+  return head and common.is_commit_hash(head) and head or nil
+end
+
+-- Manifests are indexed per checkout, commit and lpm version, so that later runs can look addons up by id without
+-- decoding the whole manifest. The index is a directory with the manifest's lite-xls and remotes in repository.json,
+-- and a file for each id, provide and replace, holding the raw entries filed under it and their places in the manifest.
+function Repository:get_index_path()
+  local head = not self:is_local() and self:get_head()
+  return head and (CACHEDIR .. PATHSEP .. "index" .. PATHSEP .. system.hash(self.local_path .. ":" .. head .. ":" .. VERSION))
+end
+
+local function get_index_key_path(index_path, key) return index_path .. PATHSEP .. system.hash(key) .. ".json" end
+
+-- Written next to where it goes, and moved into place whole; repository.json is what marks an index as complete.
+function Repository:save_index(path)
+  local staging = path .. ".part"
+  common.rmrf(staging)
+  common.mkdirp(staging)
+  for key, indices in pairs(self.entry_keys) do
+    common.write(get_index_key_path(staging, key), json.encode({ indices = indices, addons = common.map(indices, function(i) return self.entries[i] end) }))
+  end
+  common.write(staging .. PATHSEP .. "repository.json", json.encode({ ["lite-xls"] = self.manifest["lite-xls"], remotes = self.manifest["remotes"] }))
+  common.rename(staging, path)
+end
+
+-- Files the manifest's entries under their ids, and any ids they provide or replace.
+function Repository:load_entries()
+  if self.indexed and not system.exists(self.manifest_path) then self:generate_manifest() end
+  local manifest = self.indexed and json.decode(common.read(self.manifest_path)) or self.manifest
+  self.entries, self.entry_keys = manifest["addons"] or manifest["plugins"] or {}, {}
+  for i, metadata in ipairs(self.entries) do
+    Addon.check_id(metadata)
+    if math.type(metadata.version) then metadata.version = tostring(metadata.version) end
+    for _, key in ipairs(common.concat({ metadata.id }, metadata.provides or {}, metadata.replaces or {})) do
+      self.entry_keys[key] = self.entry_keys[key] or {}
+      if self.entry_keys[key][#self.entry_keys[key]] ~= i then table.insert(self.entry_keys[key], i) end
+    end
+  end
+end
+
+function Repository:materialize(i, metadata)
+  if not self.materialized[i] then self.materialized[i] = Addon.new(self, metadata or self.entries[i]) end
+  return self.materialized[i]
+end
+
+-- Manifest entries only become addons when something asks for them; either all of them, or just those that have,
+-- provide, or replace a particular id. With an index, looking up an id reads only what's filed under it.
+function Repository:get_addons(id)
+  if not self.manifest then self:parse_manifest() end
+  if not self.manifest then return {} end
+  if id and not self.entries then
+    if self.entry_keys[id] == nil then
+      local path = get_index_key_path(self.indexed, id)
+      local record = system.exists(path) and json.decode(common.read(path)) or { indices = {}, addons = {} }
+      for j, i in ipairs(record.indices) do
+        Addon.check_id(record.addons[j])
+        self:materialize(i, record.addons[j])
+      end
+      self.entry_keys[id] = record.indices
+    end
+    return common.map(self.entry_keys[id], function(i) return self.materialized[i] end)
+  end
+  if not self.entries then self:load_entries() end
+  if id then return common.map(self.entry_keys[id] or {}, function(i) return self:materialize(i) end) end
+  if not self.addons then self.addons = common.map(self.entries, function(e, i) return self:materialize(i) end) end
+  return self.addons
+end
+
 function Repository:parse_manifest(repo_id)
   if self.manifest then return self.manifest, self.remotes end
-  if system.stat(self.local_path) then
+  if system.exists(self.local_path) then
     self.manifest_path = self.local_path .. PATHSEP .. "manifest.json"
-    if not system.stat(self.manifest_path) then
+    local index_path = self:get_index_path()
+    local indexed = index_path and system.exists(index_path .. PATHSEP .. "repository.json")
+    if not indexed and not system.exists(self.manifest_path) then
       log.warning("Can't find manifest.json for " .. self:url() .. "; automatically generating manifest.")
       self:generate_manifest(repo_id)
     end
     local status, err = pcall(function()
-      self.manifest = json.decode(common.read(self.manifest_path))
-      self.addons = {}
-      self.remotes = {}
-      for i, metadata in ipairs(self.manifest["addons"] or self.manifest["plugins"] or {}) do
-        table.insert(self.addons, Addon.new(self, metadata))
+      self.entries, self.entry_keys, self.materialized, self.addons, self.indexed = nil, {}, {}, nil, indexed and index_path
+      self.manifest = json.decode(common.read(indexed and (index_path .. PATHSEP .. "repository.json") or self.manifest_path))
+      if not indexed then self:load_entries() end
+      if not self.snapshotted then -- otherwise, lpm.load_snapshot has already filled these in
+        for i, metadata in ipairs(self.manifest["lite-xls"] or {}) do
+          table.insert(self.lite_xls, LiteXL.new(self, metadata))
+        end
+        self.remotes = common.map(self.manifest["remotes"] or {}, function(r) return Repository.url(r) end)
       end
-      for i, metadata in ipairs(self.manifest["lite-xls"] or {}) do
-        table.insert(self.lite_xls, LiteXL.new(self, metadata))
+      if index_path and not indexed then
+        local status, err = pcall(self.save_index, self, index_path)
+        if not status and VERBOSE then log.warning("can't write manifest index for " .. self:url() .. ": " .. err) end
       end
-      self.remotes = common.map(self.manifest["remotes"] or {}, function(r) return Repository.url(r) end)
     end)
     if not status then error("error parsing manifest for " .. self:url() .. ": " .. err) end
   end
   return self.manifest, self.remotes or {}
 end
 
-
 function Repository:generate_manifest(repo_id)
   if not self.local_path and not self.commit and not self.branch then error("requires an instantiation") end
   local path = self.local_path
   local addons, addon_map = {}, {}
   for _, folder in ipairs({ "plugins", "colors", "libraries", "fonts" }) do
-    if system.stat(path .. PATHSEP .. "README.md") then -- If there's a README, parse it for a table like in our primary repository.
+    if system.exists(path .. PATHSEP .. "README.md") then -- If there's a README, parse it for a table like in our primary repository.
       for line in io.lines(path .. PATHSEP .. "README.md") do
         local _, _, name, path, description = line:find("^%s*%|%s*%[`([%w_]+)%??.-`%]%((.-)%).-%|%s*(.-)%s*%|%s*$")
         if name then
@@ -1243,9 +1027,9 @@ function Repository:generate_manifest(repo_id)
         end
       end
     end
-    if folder == "plugins" or system.stat(path .. PATHSEP .. folder) then
-      local addon_dir = system.stat(path .. PATHSEP .. folder) and folder or ""
-      local files = folder == "plugins" and system.stat(path .. PATHSEP .. "init.lua") and { "init.lua" } or system.ls(path .. PATHSEP .. addon_dir)
+    if folder == "plugins" or system.exists(path .. PATHSEP .. folder) then
+      local addon_dir = system.exists(path .. PATHSEP .. folder) and folder or ""
+      local files = folder == "plugins" and system.exists(path .. PATHSEP .. "init.lua") and { "init.lua" } or system.ls(path .. PATHSEP .. addon_dir)
       for i, file in ipairs(files) do
         if file:find("%.lua$") then
           local filename = common.basename(file):gsub("%.lua$", "")
@@ -1288,11 +1072,11 @@ function Repository:generate_manifest(repo_id)
   end
   if #addons == 1 and not addons[1].path then addons[1].path = "." end
   table.sort(addons, function(a,b) return a.id:lower() < b.id:lower() end)
-  common.write(path .. PATHSEP .. "manifest.json", json.encode({ addons = addons }, { pretty = true }))
+  common.write_json(path .. PATHSEP .. "manifest.json", { addons = addons }, { pretty = true })
 end
 
 function Repository:fetch_if_not_present()
-  if self.local_path and system.stat(self.local_path) then return self end
+  if self.local_path and system.exists(self.local_path) then return self end
   return self:fetch()
 end
 
@@ -1312,9 +1096,11 @@ function Repository:fetch()
   if self:is_local() then return self end
   if self.remote:find("^http") and NO_NETWORK then log.warning("ignoring fetch operation for " .. self.remote) return self end
   local path, temporary_path
+  -- unique per remote, as several repositories may be fetching at once; see Addon.unstub_all
+  local transient_path = TMPDIR .. PATHSEP .. "transient-repo-" .. system.hash(self.remote .. ":" .. (self.commit or self.branch or "")):sub(1, 16)
   local status, err = pcall(function()
     if not self.branch and not self.commit then
-      temporary_path = TMPDIR .. PATHSEP .. "transient-repo"
+      temporary_path = transient_path
       common.rmrf(temporary_path)
       common.mkdirp(temporary_path)
       log.progress_action("Fetching " .. self.remote .. "...")
@@ -1327,9 +1113,9 @@ function Repository:fetch()
       common.reset(temporary_path, self.branch, "hard")
     else
       path = self.local_path
-      local exists = system.stat(path)
+      local exists = system.exists(path)
       if not exists then
-        temporary_path = TMPDIR .. PATHSEP .. "transient-repo"
+        temporary_path = transient_path
         common.rmrf(temporary_path)
         common.mkdirp(temporary_path)
         system.init(temporary_path, self.remote)
@@ -1352,10 +1138,11 @@ function Repository:fetch()
     end
   end)
   if not status then
+    if temporary_path then common.rmrf(temporary_path) end
     if path then
       common.rmrf(path)
       local dir = common.dirname(path)
-      if system.stat(dir) and #system.ls(dir) == 0 then common.rmrf(dir) end
+      if system.exists(dir) and #system.ls(dir) == 0 then common.rmrf(dir) end
     end
     error(err, 0)
   end
@@ -1364,7 +1151,7 @@ end
 
 function Repository:add(pull_remotes, force_update)
   -- If neither specified then pull onto `master`, and check the main branch name, and move if necessary.
-  local call_update = (force_update or UPDATE) and (self.local_path and system.stat(self.local_path))
+  local call_update = (force_update or UPDATE) and (self.local_path and system.exists(self.local_path))
   self:fetch_if_not_present()
   if call_update then self:update() end
   local manifest, remotes = self:parse_manifest()
@@ -1424,9 +1211,11 @@ function LiteXL.new(repository, metadata)
     tags = {},
     files = {}
   }, metadata), LiteXL)
-  self.hash = system.hash((repository and repository:url() or "") .. "-" .. metadata.version .. common.join("", common.map(common.grep(self.files, function(f) 
-    return #common.intersection(f.arch, ARCH) > 0
-  end), function(f) return f.url .. f.checksum end)))
+  local hasher = system.hasher():update((repository and repository:url() or "") .. "-" .. metadata.version)
+  for i, file in ipairs(self.files) do
+    if #common.intersection(file.arch, ARCH) > 0 then hasher:update(file.url):update(file.checksum) end
+  end
+  self.hash = hasher:digest()
   self.local_path = self:is_local() and self.path or (CACHEDIR .. PATHSEP .. "lite_xls" .. PATHSEP .. self.version .. PATHSEP .. self.hash)
   self.binary_path = self.binary_path or { }
   self.datadir_path = self.datadir_path or (self.local_path .. PATHSEP .. "data")
@@ -1443,14 +1232,14 @@ function LiteXL:is_primary() return primary_lite_xl == self end
 function LiteXL:is_local() return not self.repository and self.path end
 function LiteXL:is_manifest() return self.repository end
 function LiteXL:is_compatible(addon) return not addon.mod_version or MOD_VERSION == "any" or compatible_modversion(self.mod_version, addon.mod_version) end
-function LiteXL:is_installed(arch) return system.stat(self.local_path) ~= nil and self:get_binary_path(arch) end
+function LiteXL:is_installed(arch) return system.exists(self.local_path) and self:get_binary_path(arch) end
 
 function LiteXL:reference(reference_type, target, force)
   if reference_type == "share" then
     local share_folder = target .. PATHSEP .. "share" .. PATHSEP .. "lite-xl"
     local binary_folder = target .. PATHSEP .. "bin"
-    assert(system.stat(share_folder), "can't find share folder " .. share_folder)
-    assert(system.stat(binary_folder), "can't find binary folder" .. binary_folder)
+    assert(system.exists(share_folder), "can't find share folder " .. share_folder)
+    assert(system.exists(binary_folder), "can't find binary folder" .. binary_folder)
     log.action(string.format("Installing lite-xl %s into %s and %s." , self.version, binary_folder, share_folder), "green")
     common.copy(self.datadir_path, share_folder .. PATHSEP .. "data")
     common.copy(self:get_binary_path(ARCH), bin_folder .. PATHSEP .. "lite-xl" .. get_executable_extension(ARCH))
@@ -1470,7 +1259,7 @@ function LiteXL:install(arch)
   if self:is_installed(arch) and not REINSTALL then log.warning("lite-xl " .. self.version .. " already installed") return end
   assert(not self:is_local(), "cannot install a local copy of lite-xl")
   local local_path = self.local_path
-  self.local_path = TMPDIR .. PATHSEP .. "lite-xls" .. PATHSEP .. self.version
+  self.local_path = STAGING[CACHEDIR] .. PATHSEP .. "lite-xls" .. PATHSEP .. self.version
   common.rmrf(self.local_path)
   common.mkdirp(self.local_path)
   if system_bottle.lite_xl == self then -- system lite-xl. We have to copy it because we can't really set the user directory.
@@ -1479,7 +1268,7 @@ function LiteXL:install(arch)
     local stat = system.stat(executable)
     executable = stat.symlink and stat.symlink or executable
     datadir = common.dirname(executable) .. PATHSEP .. "data"
-    if not system.stat(datadir) then error("can't find system lite-xl data dir") end
+    if not system.exists(datadir) then error("can't find system lite-xl data dir") end
     common.copy(executable, self.local_path .. PATHSEP .. "lite-xl")
     system.chmod(self.local_path .. PATHSEP .. "lite-xl", 448) -- chmod to rwx-------
     common.copy(datadir, self.local_path .. PATHSEP .. "data")
@@ -1515,14 +1304,14 @@ function LiteXL:install(arch)
       end
     end
   end
-  if not system.stat(self.local_path .. PATHSEP .. "lite-xl" .. get_executable_extension(ARCH[1])) then error("can't find executable for lite-xl " .. self.version .. "; does this release exist for " .. common.join(" & ", ARCH) .. "?") end
-  common.rmrf(local_path)
+  if not system.exists(self.local_path .. PATHSEP .. "lite-xl" .. get_executable_extension(ARCH[1])) then error("can't find executable for lite-xl " .. self.version .. "; does this release exist for " .. common.join(" & ", ARCH) .. "?") end
+  common.mkdirp(common.dirname(local_path))
   common.rename(self.local_path, local_path)
   self.local_path = local_path
 end
 
 function LiteXL:uninstall(force)
-  if not system.stat(self.local_path) then error("lite-xl " .. self.version .. " not installed") end
+  if not system.exists(self.local_path) then error("lite-xl " .. self.version .. " not installed") end
   if force or prompt("This will delete " .. self.local_path .. ". Are you sure you want to continue?") then 
     log.action("Uninstalling lite-xl " .. self.version .. " from "  .. self.local_path)
     common.rmrf(self.local_path)
@@ -1542,16 +1331,22 @@ function Bottle.new(metadata)
   }, Bottle)
   if not metadata.is_system then
     if self.addons then table.sort(self.addons, function(a, b) return (a.id .. ":" .. a.version) < (b.id .. ":" .. b.version) end) end
-    self.hash = system.hash(self.name or (((self.lite_xl and self.lite_xl.version or "")) .. " " .. common.join(" ", common.map(self.addons, function(p) 
-      return (p.repository and p.repository:url() or "") .. ":" .. p.id .. ":" .. p.version 
-    end)) .. (metadata.config or "") .. (EPHEMERAL and "E" or "")))
+    if self.name then
+      self.hash = system.hash(self.name)
+    else
+      local hasher = system.hasher():update((self.lite_xl and self.lite_xl.version or "") .. " ")
+      for i, p in ipairs(self.addons) do
+        hasher:update((i > 1 and " " or "") .. (p.repository and p.repository:url() or "") .. ":" .. p.id .. ":" .. p.version)
+      end
+      self.hash = hasher:update((metadata.config or "") .. (EPHEMERAL and "E" or "")):digest()
+    end
     if not self.local_path then
       if self.name then
         self.local_path = BOTTLEDIR .. PATHSEP .. "named" .. PATHSEP .. self.name
       elseif EPHEMERAL then
         for i = 1, 1000 do
           self.local_path = BOTTLEDIR .. PATHSEP .. "auto" .. PATHSEP .. self.hash .. "-" .. i
-          if not system.stat(self.local_path) then break elseif i == 1000 then error("can't create epehemeral bottle") end
+          if not system.exists(self.local_path) then break elseif i == 1000 then error("can't create epehemeral bottle") end
         end
       else
         self.local_path = BOTTLEDIR .. PATHSEP .. "auto" .. PATHSEP .. self.hash
@@ -1571,7 +1366,7 @@ function Bottle.new(metadata)
   return self
 end
 
-function Bottle:is_constructed() return self.is_system or system.stat(self.local_path) end
+function Bottle:is_constructed() return self.is_system or system.exists(self.local_path) end
 
 local DEFAULT_CONFIG_HEADER = [[
 local core = require "core"
@@ -1586,12 +1381,12 @@ function Bottle:construct(hardcopy)
   if self:is_constructed() and not REINSTALL then error("bottle " .. (self.name or self.hash) .. " already constructed") end
   -- swap out the local path for a temporary path while we construct the bottle to make things atomic
   local local_path = self.local_path
-  self.local_path = TMPDIR .. PATHSEP .. "bottles" .. PATHSEP .. (self.name or self.hash)
+  self.local_path = STAGING[BOTTLEDIR] .. PATHSEP .. "bottles" .. PATHSEP .. (self.name or self.hash)
   common.rmrf(self.local_path)
 
   if self.lite_xl and (not self.lite_xl:is_installed() or REINSTALL) and not self.lite_xl:is_local() then self.lite_xl:install() end
   common.mkdirp(self.local_path .. PATHSEP .. "user")
-  common.write(self.local_path .. PATHSEP .. "user" .. PATHSEP .. "init.lua", self.config == "system" and system.stat(USERDIR .. PATHSEP .. "init.lua") and common.read(USERDIR .. PATHSEP .. "init.lua") or (DEFAULT_CONFIG_HEADER .. (MOD_VERSION == "any" and "config.skip_plugins_version = true\n" or "") .. (self.config or "")))
+  common.write(self.local_path .. PATHSEP .. "user" .. PATHSEP .. "init.lua", self.config == "system" and system.exists(USERDIR .. PATHSEP .. "init.lua") and common.read(USERDIR .. PATHSEP .. "init.lua") or (DEFAULT_CONFIG_HEADER .. (MOD_VERSION == "any" and "config.skip_plugins_version = true\n" or "") .. (self.config or "")))
 
   if hardcopy == nil then
     hardcopy = SYMLINK == false
@@ -1602,13 +1397,22 @@ function Bottle:construct(hardcopy)
     lite_xl = lite_xl or primary_lite_xl
     hardcopy = true
   end
-  local construct = hardcopy and common.copy or common.symlink
   if lite_xl then -- if no lite_xl, we're assuming that we're using the system version with a LITE_PREFIX environment variable. 
-    construct(lite_xl:get_binary_path(), self.local_path .. PATHSEP .. "lite-xl" .. get_executable_extension(ARCH[1]))
-    if hardcopy then
-      system.chmod(self.local_path .. PATHSEP .. "lite-xl" .. get_executable_extension(ARCH[1]), 448) -- chmod to rwx-------\
-    end
-    construct(lite_xl.datadir_path, self.local_path .. PATHSEP .. "data")
+    local binary_path, data_path = self.local_path .. PATHSEP .. "lite-xl" .. get_executable_extension(ARCH[1]), self.local_path .. PATHSEP .. "data"
+    -- lay out the bottle in one native pass; files going into the store are linked individually afterwards.
+    local layout = hardcopy and {
+      { "copy_tree", lite_xl:get_binary_path(), binary_path },
+      { "chmod", binary_path, 448 }, -- chmod to rwx-------
+      not STORE and { "copy_tree", lite_xl.datadir_path, data_path } or nil
+    } or {
+      { "symlink", lite_xl:get_binary_path(), binary_path },
+      { "symlink", lite_xl.datadir_path, data_path }
+    }
+    local _, err, failed = system.batch(layout)
+    if err and hardcopy then error(err) end
+    -- symlinks can fail on windows without developer mode, which common.symlink falls back from.
+    for i = failed or #layout + 1, #layout do common.symlink(layout[i][2], layout[i][3]) end
+    if hardcopy and STORE then common.copy(lite_xl.datadir_path, data_path, nil, nil, STORE) end
     if VERBOSE then log.action(string.format("Constructing bottle from %s, %s", lite_xl:get_binary_path(), lite_xl.datadir_path)) end
   end
   local installing = {}
@@ -1618,7 +1422,6 @@ function Bottle:construct(hardcopy)
     end
   end
   -- atomically move things
-  common.rmrf(local_path)
   common.mkdirp(common.dirname(local_path))
   common.rename(self.local_path, local_path)
   self.local_path = local_path
@@ -1631,16 +1434,20 @@ function Bottle:apply(addons, config)
   local applied = {}
   local installed = {}
 
-  for i, addons in ipairs(addons) do
-    local installed_addons = common.grep(addons, function(addon) return addon:is_installed(self) or addon:is_core(self) end)
-    if #installed_addons == 0 then
-      addons[1]:install(self, applying)
+  local plan, chosen = self:resolve(addons)
+  if not plan then error("can't apply: " .. chosen) end
+  -- The plan already has every dependency ahead of what needs it, so there's no need to work them out again.
+  for i, addon in ipairs(plan) do
+    if not addon:is_installed(self) then
+      addon:install(self, applying, true)
       changes = true
-      table.insert(installed, addons[1])
-    else
-      table.insert(installed, installed_addons[1])
     end
+    table.insert(installed, addon)
+  end
+  for i, addons in ipairs(addons) do
+    table.insert(installed, chosen[addons[1].id])
     applied[addons[1].id] = true
+    applied[chosen[addons[1].id].id] = true
   end
   for i, addon in pairs(self:installed_addons()) do
     if #common.grep(installed, function(p) return p:depends_on(addon) end) == 0 then
@@ -1666,7 +1473,7 @@ end
 function Bottle:run(args)
   args = args or {}
   local path = common.exists(self.local_path .. PATHSEP .. "lite-xl" .. get_executable_extension(ARCH[1])) or (self.lite_xl or primary_lite_xl):get_binary_path()
-  if not system.stat(path) then error("cannot find bottle executable " .. path) end
+  if not system.exists(path) then error("cannot find bottle executable " .. path) end
   if PLATFORM == "windows" and path:find(" ") then path = '"' .. path:gsub('"+', function(s) return s..s end) .. '"' end
   local line = path .. (#args > 0 and " " or "") .. table.concat(common.map(args, function(arg)
     if PLATFORM == "windows" then
@@ -1683,7 +1490,7 @@ end
 
 local function get_repository_addons()
   local t, hash = { }, { }
-  for i,p in ipairs(common.flat_map(repositories, function(r) return r.addons end)) do
+  for i,p in ipairs(common.flat_map(repositories, function(r) return r:get_addons() end)) do
     local id = p:get_unique_identifier()
     if not hash[id] then
       table.insert(t, p)
@@ -1714,75 +1521,245 @@ local function get_repository_addons()
   return t, hash
 end
 
-function Bottle:invalidate_cache()
+-- If given the addon that was just installed or uninstalled, only forgets what that could have changed; the status of
+-- addons that share any of its ids, of meta addons, which depend on the status of others, and comparisons against its
+-- install path.
+function Bottle:invalidate_cache(addon)
   self.all_addons_cache = nil
-  self.installed_cache = nil
+  self.addon_index = nil
+  self.addons_by_id, self.local_listings, self.local_addons = nil, nil, nil
+  if not addon then
+    self.installed_cache = nil
+    self.difference_cache = nil
+    return
+  end
+  local ids = {}
+  for _, id in ipairs(common.concat({ addon.id }, addon.provides or {}, addon.replaces or {})) do ids[id] = true end
+  for cached in pairs(self.installed_cache or {}) do
+    if ids[cached.id] or cached.type == "meta" then self.installed_cache[cached] = nil end
+  end
+  local suffix = "\n" .. addon:get_install_path(self)
+  for key in pairs(self.difference_cache or {}) do
+    if key:sub(-#suffix) == suffix then self.difference_cache[key] = nil end
+  end
 end
 
-function Bottle:all_addons()
-  if self.all_addons_cache then return self.all_addons_cache end
-  local t, hash = get_repository_addons()
+-- A cheap fingerprint of everything that determines which addons count as installed; the metadata of everything under
+-- each install root, and the commit of each checkout. Returns nil if there's a local repository, as those can change
+-- at any time.
+function Bottle:get_state_stamp()
+  local parts = {}
+  for _, addon_type in ipairs({ "plugins", "libraries", "fonts", "colors" }) do
+    for _, root in ipairs({ (self.local_path and (self.local_path .. PATHSEP .. "user") or USERDIR) .. PATHSEP .. addon_type, self.lite_xl.datadir_path .. PATHSEP .. addon_type }) do
+      table.insert(parts, root .. "=" .. tostring(system.tree_stamp(root)))
+    end
+  end
+  -- Unstubbed addons point into the checkouts of their remotes, which needn't be configured repositories; so every
+  -- checkout in the cache counts, by the commit it has checked out.
+  local checkouts, repos_path = {}, CACHEDIR .. PATHSEP .. "repos"
+  for _, repo in ipairs(repositories) do
+    if repo:is_local() then return nil end
+    if repo.local_path then checkouts[repo.local_path] = true end
+  end
+  for _, hash in ipairs(system.exists(repos_path) and system.ls(repos_path) or {}) do
+    local repo_path = repos_path .. PATHSEP .. hash
+    if system.type(repo_path) == "dir" then
+      for _, checkout in ipairs(system.ls(repo_path)) do checkouts[repo_path .. PATHSEP .. checkout] = true end
+    end
+  end
+  for _, path in ipairs(common.canonical_order(checkouts)) do
+    table.insert(parts, path .. "=" .. tostring(Repository.get_head({ local_path = path })))
+  end
+  return system.hash(table.concat(parts, "\n"))
+end
+
+function Bottle:get_state_path()
+  if not self.is_system and not self.name then return nil end
+  return CACHEDIR .. PATHSEP .. "state" .. PATHSEP .. system.hash(self.local_path or USERDIR) .. ".json"
+end
+
+-- Comparing installed addons against their sources is the bulk of working out what's installed; so the results are
+-- kept in a state file, and reused by later runs as long as the bottle's state stamp hasn't changed.
+function Bottle:is_addon_different(downloaded_path, installed_path)
+  if not self.difference_cache then
+    self.difference_cache, self.state_stamp = {}, self:get_state_stamp()
+    local path = self:get_state_path()
+    if path and self.state_stamp and system.exists(path) then
+      local status, state = pcall(json.decode, common.read(path))
+      if status and type(state) == "table" and state.stamp == self.state_stamp and type(state.different) == "table" then self.difference_cache = state.different end
+    end
+  end
+  local key = downloaded_path .. "\n" .. installed_path
+  if self.difference_cache[key] == nil then
+    self.difference_cache[key] = Addon.is_addon_different(downloaded_path, installed_path) and true or false
+    self.state_dirty = true
+  end
+  return self.difference_cache[key]
+end
+
+-- Only written if nothing changed while we were working things out.
+function Bottle:save_state()
+  local path = self:get_state_path()
+  if not self.state_dirty or not path or not self.state_stamp or self:get_state_stamp() ~= self.state_stamp then return end
+  common.mkdirp(common.dirname(path))
+  common.write_json(path, { stamp = self.state_stamp, different = self.difference_cache })
+  self.state_dirty = false
+end
+
+-- What's in each of the bottle's install roots; user first, then the lite-xl data directory, for each type of addon.
+function Bottle:get_local_listings()
+  if self.local_listings then return self.local_listings end
+  self.local_listings = {}
   for _, addon_type in ipairs({ "plugins", "libraries", "fonts", "colors" }) do
-    local addon_paths = {
+    for i, addon_path in ipairs({
       (self.local_path and (self.local_path .. PATHSEP .. "user") or USERDIR) .. PATHSEP .. addon_type,
       self.lite_xl.datadir_path .. PATHSEP .. addon_type
-    }
-    for i, addon_path in ipairs(addon_paths) do
-      if system.stat(addon_path) then
-        for j, v in ipairs(system.ls(addon_path)) do
-          local id = common.handleize(v:gsub("%.lua$", ""))
-          local path = addon_path .. PATHSEP .. v
-          -- in the case where we have an existing plugin that targets a stub, then fetch that repository
-          local fetchable = hash[id] and common.grep(hash[id], function(e) return e:is_stub() end)[1]
-          if fetchable then fetchable:unstub() end
-          local matching = hash[id] and common.grep(hash[id], function(e)
-            return e.local_path and not Addon.is_addon_different(e.local_path, path)
-          end)[1]
-          if i == 2 or not hash[id] or not matching then
-            local translations = {
-              plugins = "plugin",
-              libraries = "library",
-              fonts = "font",
-              colors = "color"
-            }
-            table.insert(t, Addon.new(nil, {
-              id = id,
-              type = (translations[addon_type] or "plugin"),
-              location = (i == 2 and (hash[id] and "bundled" or "core")) or "user",
-              organization = (v:find("%.lua$") and "singleton" or "complex"),
-              local_path = path,
-              mod_version = self.lite_xl.mod_version,
-              path = addon_type .. PATHSEP .. v,
-              description = (hash[id] and hash[id][1].description or nil),
-              repo_path = (hash[id] and hash[id][1].local_path or nil),
-              dependencies = (hash[id] and hash[id][1].dependencies or nil)
-            }))
-            if not hash[id] then hash[id] = { t[#t] } end
-          end
-        end
+    }) do
+      table.insert(self.local_listings, { addon_type = addon_type, addon_path = addon_path, i = i, files = system.exists(addon_path) and system.ls(addon_path) or {} })
+    end
+  end
+  return self.local_listings
+end
+
+-- Returns the addon for a file in one of the install roots, if it isn't just an installed copy of one of the repository
+-- addons with its id; those go first in candidates. Kept by path, so that all_addons and get_addons_by_id agree.
+function Bottle:get_local_addon(listing, file, candidates)
+  local addon_type, addon_path, i = listing.addon_type, listing.addon_path, listing.i
+  local path = addon_path .. PATHSEP .. file
+  local matching = candidates and common.grep(candidates, function(e)
+    return e.local_path and not self:is_addon_different(e.local_path, path)
+  end)[1]
+  if i == 2 or not candidates or not matching then
+    self.local_addons = self.local_addons or {}
+    if not self.local_addons[path] then
+      local translations = {
+        plugins = "plugin",
+        libraries = "library",
+        fonts = "font",
+        colors = "color"
+      }
+      self.local_addons[path] = Addon.new(nil, {
+        id = common.handleize(file:gsub("%.lua$", "")),
+        type = (translations[addon_type] or "plugin"),
+        location = (i == 2 and (candidates and "bundled" or "core")) or "user",
+        organization = (file:find("%.lua$") and "singleton" or "complex"),
+        local_path = path,
+        mod_version = self.lite_xl.mod_version,
+        path = addon_type .. PATHSEP .. file,
+        description = (candidates and candidates[1].description or nil),
+        repo_path = (candidates and candidates[1].local_path or nil),
+        dependencies = (candidates and candidates[1].dependencies or nil)
+      })
+    end
+    return self.local_addons[path]
+  end
+end
+
+function Bottle:get_core_addon(id)
+  self.local_addons = self.local_addons or {}
+  if not self.local_addons[id] then
+    self.local_addons[id] = Addon.new(nil, {
+      id = id,
+      type = "plugin",
+      location = "core",
+      organization = "singleton",
+      local_path = nil,
+      mod_version = self.lite_xl.mod_version,
+      path = "plugins" .. PATHSEP .. id .. ".lua"
+    })
+  end
+  return self.local_addons[id]
+end
+
+function Bottle:all_addons()
+  if self.all_addons_cache then return self.all_addons_cache end
+  local t, hash = get_repository_addons()
+  local listings, fetchables = self:get_local_listings(), {}
+  for _, listing in ipairs(listings) do
+    -- in the case where we have an existing plugin that targets a stub, then fetch that repository
+    for _, v in ipairs(listing.files) do
+      local id = common.handleize(v:gsub("%.lua$", ""))
+      local fetchable = hash[id] and common.grep(hash[id], function(e) return e:is_stub() end)[1]
+      if fetchable then table.insert(fetchables, fetchable) end
+    end
+  end
+  Addon.unstub_all(fetchables)
+  for _, listing in ipairs(listings) do
+    for j, v in ipairs(listing.files) do
+      local id = common.handleize(v:gsub("%.lua$", ""))
+      local addon = self:get_local_addon(listing, v, hash[id])
+      if addon then
+        table.insert(t, addon)
+        if not hash[id] then hash[id] = { addon } end
       end
     end
   end
   -- Ensure we have at least one instance of each core plugin.
   for id, v in pairs(CORE_PLUGINS) do
-    if not hash[id] then
-      table.insert(t, Addon.new(nil, {
-        id = id,
-        type = "plugin",
-        location = "core",
-        organization = "singleton",
-        local_path = nil,
-        mod_version = self.lite_xl.mod_version,
-        path = "plugins" .. PATHSEP .. id .. ".lua"
-      }))
-    end
+    if not hash[id] then table.insert(t, self:get_core_addon(id)) end
   end
   self.all_addons_cache = t
+  self:save_state()
+  return t
+end
+
+-- The bottle's addons that have, provide or replace an id; the same as get_addon_index()[id], but only looks at that
+-- id in each repository, and the files for it in the install roots, rather than building the whole catalogue.
+function Bottle:get_addons_by_id(id)
+  if self.all_addons_cache then return self:get_addon_index()[id] or {} end
+  self.addons_by_id = self.addons_by_id or {}
+  if self.addons_by_id[id] then return self.addons_by_id[id] end
+  local t = {}
+  for i, repo in ipairs(repositories) do
+    for _, addon in ipairs(repo:get_addons(id)) do
+      -- as in get_repository_addons, the first repository with a particular version of an addon is the one that counts
+      local shadowed = false
+      for j = 1, i - 1 do
+        if common.first(repositories[j]:get_addons(addon.id), function(e) return e:get_unique_identifier() == addon:get_unique_identifier() end) then shadowed = true end
+      end
+      if not shadowed and not common.first(t, function(e) return e:get_unique_identifier() == addon:get_unique_identifier() end) then table.insert(t, addon) end
+    end
+  end
+  local candidates = common.grep(t, function(addon) return addon.id == id end)
+  if #candidates == 0 then candidates = nil end
+  local listings = common.map(self:get_local_listings(), function(listing)
+    return { listing = listing, files = common.grep(listing.files, function(v) return common.handleize(v:gsub("%.lua$", "")) == id end) }
+  end)
+  if candidates and common.first(listings, function(l) return #l.files > 0 end) then
+    Addon.unstub_all({ common.grep(candidates, function(e) return e:is_stub() end)[1] })
+  end
+  for _, l in ipairs(listings) do
+    for _, v in ipairs(l.files) do
+      local addon = self:get_local_addon(l.listing, v, candidates)
+      if addon then
+        table.insert(t, addon)
+        if not candidates then candidates = { addon } end
+      end
+    end
+  end
+  if not candidates and CORE_PLUGINS[id] then table.insert(t, self:get_core_addon(id)) end
+  self.addons_by_id[id] = t
   return t
 end
 
+-- All of the bottle's addons, filed under their ids, and any ids they provide or replace.
+function Bottle:get_addon_index()
+  if self.addon_index then return self.addon_index end
+  local index = {}
+  for _, addon in ipairs(self:all_addons()) do
+    for _, key in ipairs(common.concat({ addon.id }, addon.provides or {}, addon.replaces or {})) do
+      index[key] = index[key] or {}
+      if index[key][#index[key]] ~= addon then table.insert(index[key], addon) end
+    end
+  end
+  self.addon_index = index
+  return index
+end
+
 function Bottle:installed_addons()
-  return common.grep(self:all_addons(), function(p) return p:is_installed(self) end)
+  local installed = common.grep(self:all_addons(), function(p) return p:is_installed(self) end)
+  self:save_state()
+  return installed
 end
 
 -- ["deprecated", "language"] is things which are deprecated, OR a language.
@@ -1837,9 +1814,11 @@ function Bottle:get_addon(id, version, filter)
   if filter.repository then
     local repo = Repository.get_or_create(filter.repository)
     repo:fetch_if_not_present():parse_manifest()
-    addons = repo.addons or {}
-  else
+    addons = wildcard and repo:get_addons() or repo:get_addons(id)
+  elseif wildcard then
     addons = self:all_addons()
+  else
+    addons = self:get_addons_by_id(id)
   end
 
   for i,addon in ipairs(addons) do
@@ -1857,6 +1836,174 @@ function Bottle:get_addon(id, version, filter)
   end))
 end
 
+-- Works out a consistent set of addons satisfying every request (a list of candidate addons, in order of preference),
+-- taking into account what's already installed, along with their dependencies, provides, replaces, conflicts,
+-- mod_versions and arches. Installed addons are preferred, but are upgraded or replaced if something needs them to be.
+-- Does a depth-first search over the candidates for each requirement. When a choice leads to a dead end, the search
+-- backjumps to the most recent choice that had a part in it, rather than retrying everything in between. Returns a list
+-- of the addons that need installing, dependencies first, along with a table of the chosen addons by id, provides and
+-- replaces; or nil, and an explanation of why the requests can't be met.
+function Bottle:resolve(requests)
+  local filter = MOD_VERSION ~= "any" and { mod_version = self.lite_xl.mod_version } or nil
+  local function present(addon) return addon:is_core(self) or addon:is_installed(self) end
+  local function keys(addon) return common.concat({ addon.id }, addon.provides or {}, addon.replaces or {}) end
+  local function describe(addon) return addon.id .. (addon.version and (":" .. addon.version) or "") end
+
+  -- Each addon is chosen at a level; the index of the need it was chosen for, or nil for core addons, which are fixed.
+  local chosen, chosen_at, conflicted_by, selected, needs, installed = {}, {}, {}, {}, {}, {}
+  local function select(addon, level)
+    local taken = {}
+    for _, key in ipairs(keys(addon)) do
+      if not chosen[key] then chosen[key], chosen_at[key] = addon, level table.insert(taken, key) end
+    end
+    for id in pairs(addon.conflicts) do
+      conflicted_by[id] = conflicted_by[id] or {}
+      table.insert(conflicted_by[id], { addon = addon, level = level })
+    end
+    selected[addon] = (selected[addon] or 0) + 1
+    return function()
+      for _, key in ipairs(taken) do chosen[key], chosen_at[key] = nil, nil end
+      for id in pairs(addon.conflicts) do table.remove(conflicted_by[id]) end
+      selected[addon] = selected[addon] > 1 and selected[addon] - 1 or nil
+    end
+  end
+  -- Returns why an addon conflicts with what's been chosen so far, and the level responsible, if any.
+  local function conflicting(addon)
+    for id, conflict in pairs(addon.conflicts) do
+      local other = chosen[id]
+      if other and other ~= addon and match_version(other.version, conflict.version) then return describe(addon) .. " conflicts with " .. describe(other), chosen_at[id] end
+    end
+    for _, key in ipairs(keys(addon)) do
+      for _, other in ipairs(conflicted_by[key] or {}) do
+        if other.addon ~= addon and match_version(addon.version, other.addon.conflicts[key].version) then return describe(other.addon) .. " conflicts with " .. describe(addon), other.level end
+      end
+    end
+  end
+  -- As above, but for any reason an addon can't be chosen.
+  local function incompatibility(addon)
+    local reason, level = conflicting(addon)
+    if reason then return reason, level end
+    local supported, arch = addon:supports_arch()
+    if not supported then return describe(addon) .. " does not support arch " .. arch end
+  end
+
+  local requested = {}
+  for _, candidates in ipairs(requests) do
+    requested[candidates[1].id] = true
+    table.insert(needs, { id = candidates[1].id, candidates = common.concat(common.grep(candidates, present), common.grep(candidates, function(c) return not present(c) end)) })
+  end
+  -- Installed and core addons are found through what's in the install roots, so as not to need the whole catalogue.
+  local ids, seen = {}, {}
+  for _, listing in ipairs(self:get_local_listings()) do
+    for _, file in ipairs(listing.files) do ids[common.handleize(file:gsub("%.lua$", ""))] = true end
+  end
+  for id in pairs(CORE_PLUGINS) do ids[id] = true end
+  for _, id in ipairs(settings.installed or {}) do ids[id] = true end
+  for _, id in ipairs(common.canonical_order(ids)) do
+    for _, addon in ipairs(self:get_addons_by_id(id)) do
+      if not seen[addon] and addon.id == id and not requested[addon.id] and present(addon) then
+        if addon:is_core(self) then select(addon) else table.insert(installed, addon) end
+      end
+      seen[addon] = true
+    end
+  end
+  self:save_state()
+
+  -- Failures return the set of levels whose choices led to them; the need's parent, and whatever it clashed with.
+  local explanation, depth = nil, 0
+  local function fail(i, reason, culprits)
+    if i >= depth then explanation, depth = reason, i end
+    return false, culprits or {}
+  end
+  local function blame(culprits, level)
+    if level then culprits[level] = true end
+    return culprits
+  end
+  local function search(i)
+    local need = needs[i]
+    if not need then
+      -- Installed addons nothing has asked about stay as they are, unless they clash with what's been chosen; then they
+      -- need deciding like anything else, and may be upgraded or replaced, in the hope that something will do.
+      for _, other in ipairs(installed) do
+        if not chosen[other.id] then
+          local reason, level = conflicting(other)
+          if reason then
+            needs[i] = { id = other.id, level = level }
+            return search(i)
+          end
+        end
+      end
+      return true
+    end
+    local existing = chosen[need.id]
+    if existing then
+      if need.candidates and common.first(need.candidates, function(c) return c == existing end) then return search(i + 1) end
+      if not need.candidates and match_version(existing.version, need.version) then return search(i + 1) end
+      return fail(i, (need.parent and (need.parent.id .. " requires ") or "requested ") .. need.id .. (need.version and (":" .. need.version) or "") .. ", but " ..
+        describe(existing) .. (present(existing) and " is installed" or " is also needed"), blame(blame({}, need.level), chosen_at[need.id]))
+    end
+    local candidates = need.candidates or common.sort({ self:get_addon(need.id, need.version, filter) }, function(a, b)
+      if present(a) ~= present(b) then return present(a) end
+      local comparison = compare_version(a.version, b.version) or 0
+      if comparison ~= 0 then return comparison > 0 end
+      return not a:is_stub() and b:is_stub()
+    end)
+    local culprits = blame({}, need.level)
+    if #candidates == 0 then return fail(i, "can't find dependency " .. need.id .. (need.version and (":" .. need.version) or "") .. (need.parent and (" of " .. need.parent.id) or ""), culprits) end
+    for _, candidate in ipairs(candidates) do
+      local reason, level
+      if chosen[candidate.id] and chosen[candidate.id] ~= candidate then
+        reason, level = describe(candidate) .. " clashes with " .. describe(chosen[candidate.id]), chosen_at[candidate.id]
+      elseif not selected[candidate] then
+        reason, level = incompatibility(candidate)
+      end
+      if reason then
+        fail(i, reason)
+        blame(culprits, level)
+      else
+        local count = #needs
+        if not selected[candidate] and (need.candidates or not present(candidate)) then
+          for _, id in ipairs(common.canonical_order(candidate.dependencies)) do
+            local v = candidate.dependencies[id]
+            if not v.optional then table.insert(needs, { id = id, version = v.version, parent = candidate, level = i }) end
+          end
+        end
+        local undo = select(candidate, i)
+        local success, cause = search(i + 1)
+        if success then return true end
+        undo()
+        for j = #needs, count + 1, -1 do needs[j] = nil end
+        -- If this choice played no part in the failure, no other choice here will fare any better.
+        if not cause[i] then return false, cause end
+        for culprit in pairs(cause) do if culprit ~= i then culprits[culprit] = true end end
+      end
+    end
+    return false, culprits
+  end
+  if not search(1) then return nil, explanation end
+
+  local plan, visited = {}, {}
+  local function visit(addon, path)
+    if visited[addon] == "visiting" then return fail(#needs + 1, "circular dependency detected in " .. common.join(" -> ", common.concat(path, { addon.id }))) end
+    if visited[addon] then return true end
+    visited[addon] = "visiting"
+    for _, id in ipairs(common.canonical_order(addon.dependencies)) do
+      local dependency = chosen[id]
+      if dependency and selected[dependency] and not present(dependency) and not visit(dependency, common.concat(path, { addon.id })) then return false end
+    end
+    visited[addon] = true
+    table.insert(plan, addon)
+    return true
+  end
+  for _, need in ipairs(needs) do
+    local addon = chosen[need.id]
+    if not present(addon) or need.candidates then
+      if not visit(addon, {}) then return nil, explanation end
+    end
+  end
+  return common.grep(plan, function(addon) return not present(addon) end), chosen
+end
+
 local function get_repository(url)
   if not url then error("requires a repository url") end
   local r = Repository.url(url)
@@ -1869,7 +2016,7 @@ local function get_repository(url)
 end
 
 function lpm.settings_save()
-  common.write(CONFIGDIR .. PATHSEP .. "settings.json", json.encode(settings))
+  common.write_json(CONFIGDIR .. PATHSEP .. "settings.json", settings)
 end
 
 
@@ -1882,7 +2029,7 @@ end
 local DEFAULT_REPOS
 function lpm.repo_init(repos)
   DEFAULT_REPOS = { Repository.url(DEFAULT_REPO_URL) }
-  if not system.stat(CONFIGDIR .. PATHSEP .. "settings.json") then
+  if not system.exists(CONFIGDIR .. PATHSEP .. "settings.json") then
     for i, repository in ipairs(repos or DEFAULT_REPOS) do
       table.insert(repositories, repository:add(true))
     end
@@ -2069,7 +2216,7 @@ function lpm.lite_xl_switch(version, target)
             -- if that's the case the case, then find a better place on the path to place our symlink/bundle
             find_new_location = true
           end
-        elseif system.stat(share_folder) and bin_folder:find("bin$") and not system.stat(bin_folder .. PATHSEP .. "data") then
+        elseif system.exists(share_folder) and bin_folder:find("bin$") and not system.exists(bin_folder .. PATHSEP .. "data") then
           -- /bin /share sitatuion
           if REINSTALL then
             -- nuke the binary and /share/lite-xl folders
@@ -2084,7 +2231,7 @@ function lpm.lite_xl_switch(version, target)
             -- if we're not reinstalling, find a better place for this bundle
             find_new_location = true
           end
-        elseif system.stat(bin_folder .. PATHSEP .. "data") then
+        elseif system.exists(bin_folder .. PATHSEP .. "data") then
           -- portable ish install
           if REINSTALL then
             common.rmrf(bin_folder .. PATHSEP .. "lite-xl")
@@ -2132,7 +2279,7 @@ function lpm.lite_xl_switch(version, target)
             if prompt(string.format("Install symlink to lite-xl %s in %s?", primary_lite_xl.version, paths[i])) then
               primary_lite_xl:reference("symlink", paths[i] .. PATHSEP .. common.basename(primary_lite_xl:get_binary_path()))
             end
-          elseif path:find("bin$") and system.stat(common.dirname(paths[i]) .. PATHSEP .. "share") then
+          elseif path:find("bin$") and system.exists(common.dirname(paths[i]) .. PATHSEP .. "share") then
             if prompt(string.format("Install lite-xl %s into %s and %s?", primary_lite_xl.version, paths[i], common.dirname(paths[i]) .. PATHSEP .. "share")) then
               primary_lite_xl:reference("share", common.dirname(paths[i]))
             end
@@ -2189,7 +2336,8 @@ function lpm.lite_xl_list()
     end
   end
   if JSON then
-    io.stdout:write(json.encode(result) .. "\n")
+    json.encode(result, nil, io.stdout)
+    io.stdout:write("\n")
   else
     if VERBOSE then
       for i, lite_xl in ipairs(result["lite-xls"]) do
@@ -2272,6 +2420,27 @@ function lpm.apply(...)
   end
 end
 
+function lpm.plan(...)
+  local arguments = { ... }
+  local addons, i = lpm.retrieve_addons(system_bottle.lite_xl, arguments)
+  if #arguments >= i then error("invalid use of --") end
+  local plan, err = system_bottle:resolve(addons)
+  if not plan then error("can't resolve: " .. err) end
+  local function upgrading(addon) return common.first({ system_bottle:get_addon(addon.id) }, function(a) return a ~= addon and a:is_installed(system_bottle) end) end
+  if JSON then
+    json.encode({ plan = common.map(plan, function(addon)
+      return { id = addon.id, version = addon.version, type = addon.type, repository = addon.repository and addon.repository:url(), action = upgrading(addon) and "upgrade" or "install" }
+    end) }, nil, io.stdout)
+    io.stdout:write("\n")
+  elseif #plan == 0 then
+    log.action("Nothing to install.", "green")
+  else
+    for _, addon in ipairs(plan) do
+      print(string.format("%-8s %-30s %-12s %s", upgrading(addon) and "upgrade" or "install", addon.id, addon.version or "", addon.repository and addon.repository:url() or ""))
+    end
+  end
+end
+
 function lpm.retrieve_installable_addons(lite_xl, arguments, filters)
   local potential_addons, i = lpm.retrieve_addons(lite_xl, arguments, filters)
   return common.map(potential_addons, function(potentials)
@@ -2408,7 +2577,8 @@ local function print_addon_info(type, addons, filters)
     end
   end
   if JSON then
-    io.stdout:write(json.encode(result) .. "\n")
+    json.encode(result, nil, io.stdout)
+    io.stdout:write("\n")
   elseif #result[plural] > 0 then
     local sorted = common.sort(result[plural], function(a,b) return a.id < b.id end)
     if not VERBOSE and not TABLE and not RAW then
@@ -2466,9 +2636,9 @@ function lpm.unstub(type, ...)
   for i, potential_addon in ipairs(lpm.retrieve_addons(primary_lite_xl, arguments)) do
     local stubbed_addons = common.grep(potential_addon, function(e) return e:is_stub() end)
     assert_warning(#stubbed_addons > 0, (potential_addon[1].type or "addon") .. " " .. potential_addon[1].id .. " already unstubbed")
-    common.each(stubbed_addons, function(e) e:unstub() end)
     addons = common.concat(addons, stubbed_addons)
   end
+  Addon.unstub_all(addons)
   print_addon_info(nil, addons)
 end
 
@@ -2491,10 +2661,10 @@ function lpm.addon_reinstall(type, ...) for i, id in ipairs({ ... }) do pcall(lp
 
 function lpm.repo_list()
   if JSON then
-    io.stdout:write(json.encode({ repositories = common.map(repositories, function(repo) return { remote = repo.remote, commit = repo.commit, branch = repo.branch, path = repo.local_path, remotes = common.map(repo.remotes or {}, function(r) return r:url() end)  } end) }) .. "\n")
+    json.encode({ repositories = common.map(repositories, function(repo) return { remote = repo.remote, commit = repo.commit, branch = repo.branch, path = repo.local_path, remotes = common.map(repo.remotes or {}, function(r) return r:url() end)  } end) }, nil, io.stdout)
+    io.stdout:write("\n")
   else
     for i, repository in ipairs(repositories) do
-      local _, remotes = repository:parse_manifest()
       if i ~= 0 then print("---------------------------") end
       if not repository:is_local() then print("Remote :  " .. repository:url()) end
       print("Path   :  " .. repository.local_path)
@@ -2587,7 +2757,7 @@ end
 
 function lpm.bottle_list(name, ...)
   local named_folder = BOTTLEDIR .. PATHSEP .. "named"
-  local bottles = common.map(system.stat(named_folder) and system.ls(named_folder) or {}, function(e) return Bottle.new({ name = e }) end)
+  local bottles = common.map(system.exists(named_folder) and system.ls(named_folder) or {}, function(e) return Bottle.new({ name = e }) end)
   local result = { ["bottles"] = { } }
   local max_version = 0
   for i,bottle in ipairs(bottles) do
@@ -2598,7 +2768,8 @@ function lpm.bottle_list(name, ...)
     })
   end
   if JSON then
-    io.stdout:write(json.encode(result) .. "\n")
+    json.encode(result, nil, io.stdout)
+    io.stdout:write("\n")
   else
     if VERBOSE then
       for i, bottle in ipairs(result.bottles) do
@@ -2618,15 +2789,35 @@ function lpm.bottle_purge()
   log.action("Purged " .. BOTTLEDIR .. ".", "green")
 end
 
+-- Staging directories other than TMPDIR, that were placed in install roots on other devices.
+local function get_staging_dirs()
+  local dirs = {}
+  for root, dir in pairs(STAGING or {}) do if dir ~= TMPDIR then table.insert(dirs, dir) end end
+  return dirs
+end
+
 function lpm.cache_purge()
-  for i, dir in ipairs({ TMPDIR, CACHEDIR }) do
+  for i, dir in ipairs(common.concat(get_staging_dirs(), { TMPDIR, CACHEDIR })) do
     common.rmrf(dir)
     log.action("Purged " .. dir .. ".", "green")
   end
 end
 
+function lpm.store_gc()
+  local store = CACHEDIR .. PATHSEP .. "store"
+  local removed = 0
+  -- Anything left with a single link isn't installed anywhere anymore.
+  for i, name in ipairs(system.exists(store) and system.ls(store) or {}) do
+    if system.stat(store .. PATHSEP .. name, "links") == 1 then
+      os.remove(store .. PATHSEP .. name)
+      removed = removed + 1
+    end
+  end
+  log.action("Removed " .. removed .. " unreferenced files from " .. store .. ".", "green")
+end
+
 function lpm.purge()
-  for i, dir in ipairs({ BOTTLEDIR, CONFIGDIR, TMPDIR, CACHEDIR }) do
+  for i, dir in ipairs(common.concat(get_staging_dirs(), { BOTTLEDIR, CONFIGDIR, TMPDIR, CACHEDIR })) do
     common.rmrf(dir)
     log.action("Purged " .. dir .. ".", "green")
   end
@@ -2637,7 +2828,7 @@ function lpm.setup()
   settings = { lite_xls = {}, repositories = {}, installed = {}, version = VERSION }
   lpm.repo_init(ARGS[2] == "init" and #ARGS > 2 and (ARGS[3] ~= "none" and common.map(common.slice(ARGS, 3), function(url) return Repository.url(url) end) or {}) or nil)
   repositories, lite_xls = {}, {}
-  if system.stat(CONFIGDIR .. PATHSEP .. "settings.json") then settings = json.decode(common.read(CONFIGDIR .. PATHSEP .. "settings.json")) end
+  if system.exists(CONFIGDIR .. PATHSEP .. "settings.json") then settings = json.decode(common.read(CONFIGDIR .. PATHSEP .. "settings.json")) end
   if REPOSITORY then
     for i, url in ipairs(type(REPOSITORY) == "table" and REPOSITORY or { REPOSITORY }) do
       table.insert(repositories, Repository.url(url):add(AUTO_PULL_REMOTES))
@@ -2654,8 +2845,8 @@ function lpm.setup()
     end
   end
 
-  if BINARY and not system.stat(BINARY) then error("can't find specified --binary") end
-  if DATADIR and not system.stat(DATADIR) then error("can't find specified --datadir") end
+  if BINARY and not system.exists(BINARY) then error("can't find specified --binary") end
+  if DATADIR and not system.exists(DATADIR) then error("can't find specified --datadir") end
   local lite_xl_binary = BINARY or common.path("lite-xl" .. get_executable_extension(PLATFORM))
   if lite_xl_binary then
     local stat = system.stat(lite_xl_binary)
@@ -2667,13 +2858,13 @@ function lpm.setup()
 
       local directory = common.dirname(lite_xl_binary)
       local lite_xl_datadirs = { DATADIR or "", directory .. PATHSEP .. "data", directory:find(PATHSEP .. "bin$") and common.dirname(directory) .. PATHSEP .. "share" .. PATHSEP .. "lite-xl" or "", directory .. PATHSEP .. "data" }
-      local lite_xl_datadir = common.first(lite_xl_datadirs, function(p) return p and system.stat(p) end)
+      local lite_xl_datadir = common.first(lite_xl_datadirs, function(p) return p and system.exists(p) end)
 
       if not BINARY and not DATADIR and system_lite_xl then error("can't find existing system lite (does " .. system_lite_xl:get_binary_path() .. " exist? was it moved?); run `lpm purge`, or specify --binary and --datadir.") end
       local mod_version = MOD_VERSION
       if lite_xl_datadir and (mod_version == "any" or not mod_version) then
         local path = lite_xl_datadir .. PATHSEP .. "core" .. PATHSEP .. "start.lua"
-        if system.stat(path) then
+        if system.exists(path) then
           mod_version = common.read(path):match("MOD_VERSION_MAJOR%s=%s(%d+)")
         end
       end
@@ -2703,6 +2894,111 @@ function lpm.setup()
   if not primary_lite_xl then primary_lite_xl = lite_xls[1] end
 end
 
+-- Read-only commands can start from a snapshot of what lpm.setup worked out last time, rather than going through it
+-- all again. Snapshots are filed under the options that affect setup, and only used if the stamp of setup's inputs
+-- still matches; settings.json, each repository's checkout or manifest, and the system lite-xl's binary and start.lua.
+local SNAPSHOT_VERSION = 1
+
+local function get_snapshot_path()
+  local options = { VERSION, SNAPSHOT_VERSION, USERDIR, CONFIGDIR, PLATFORM, common.join(",", ARCH), tostring(BINARY), tostring(DATADIR), tostring(MOD_VERSION), tostring(os.getenv("PATH")) }
+  return CACHEDIR .. PATHSEP .. "snapshot" .. PATHSEP .. system.hash(common.join("\n", options)) .. ".json"
+end
+
+local function get_snapshot_stamp(repos, lite_xl)
+  local parts = {}
+  local function stat(path) table.insert(parts, path .. "=" .. common.join(":", common.map({ system.stat(path, "modified", "size") }, tostring))) end
+  -- Edits that keep the size, like lite-xl switch moving "primary", can land within the same second, so these go by content.
+  local function contents(path) table.insert(parts, path .. "=" .. tostring(system.exists(path) and system.hash(common.read(path)))) end
+  contents(CONFIGDIR .. PATHSEP .. "settings.json")
+  for _, repo in ipairs(repos) do
+    if repo:is_local() then
+      contents(repo.local_path .. PATHSEP .. "manifest.json")
+    else
+      table.insert(parts, repo:url() .. "=" .. tostring(repo.local_path and system.exists(repo.local_path) and repo:get_head()))
+    end
+  end
+  -- lpm.setup picks the system lite-xl by following whatever's on the PATH, so that lookup has to match too, even if it found nothing.
+  local binary = BINARY or common.path("lite-xl" .. get_executable_extension(PLATFORM))
+  local binary_stat = binary and system.stat_fast(binary)
+  table.insert(parts, "binary=" .. tostring(binary) .. ":" .. tostring(binary_stat and binary_stat.symlink))
+  if lite_xl and lite_xl.binary_path then stat(lite_xl.binary_path) end
+  if lite_xl and lite_xl.datadir_path then stat(lite_xl.datadir_path .. PATHSEP .. "core" .. PATHSEP .. "start.lua") end
+  return system.hash(table.concat(parts, "\n"))
+end
+
+local function is_read_only(args)
+  return args[2] == "list" or args[2] == "describe" or
+    ((args[2] == "repo" or args[2] == "lite-xl") and (#args == 2 or args[3] == "list")) or
+    ((args[2] == "plugin" or args[2] == "color" or args[2] == "library" or args[2] == "font") and (#args == 2 or args[3] == "list"))
+end
+
+function lpm.save_snapshot()
+  if REPOSITORY or not system.exists(CONFIGDIR .. PATHSEP .. "settings.json") then return end
+  local function metadata(lite_xl)
+    return { version = lite_xl.version, mod_version = lite_xl.mod_version, binary_path = lite_xl.binary_path, datadir_path = lite_xl.datadir_path, files = lite_xl.files, path = lite_xl.path, tags = lite_xl.tags }
+  end
+  -- lite-xls are either one of ours, one of a repository's, or a standalone one that only the system bottle knows about
+  local system_lite_xl = system_bottle.lite_xl
+  local function reference(lite_xl)
+    if not lite_xl then return nil end
+    for i, l in ipairs(lite_xls) do if l == lite_xl then return { lite_xl = i } end end
+    for i, repo in ipairs(repositories) do
+      for j, l in ipairs(repo.lite_xls) do if l == lite_xl then return { repository = i, index = j } end end
+    end
+    return { metadata = metadata(lite_xl) }
+  end
+  local inputs = system_lite_xl and { binary_path = system_lite_xl:get_binary_path(), datadir_path = system_lite_xl.datadir_path }
+  local snapshot = {
+    version = SNAPSHOT_VERSION,
+    stamp = get_snapshot_stamp(repositories, inputs),
+    inputs = inputs,
+    settings = settings,
+    lite_xls = common.map(lite_xls, metadata),
+    repositories = common.map(repositories, function(repo)
+      return { lite_xls = common.map(repo.lite_xls, metadata), remotes = common.map(repo.remotes or {}, function(r) return r:url() end) }
+    end),
+    system = reference(system_lite_xl),
+    primary = primary_lite_xl == system_lite_xl and { system = true } or reference(primary_lite_xl)
+  }
+  local path = get_snapshot_path()
+  common.mkdirp(common.dirname(path))
+  common.write_json(path, snapshot)
+end
+
+-- Sets up the same globals as lpm.setup, from the snapshot; returns false, having touched nothing, if it's missing or stale.
+function lpm.load_snapshot()
+  if REPOSITORY then return false end
+  local path = get_snapshot_path()
+  if not system.exists(path) then return false end
+  local status, snapshot = pcall(json.decode, common.read(path))
+  if not status or type(snapshot) ~= "table" or snapshot.version ~= SNAPSHOT_VERSION then return false end
+  local repos = common.map(snapshot.settings.repositories or {}, function(url) return Repository.url(url) end)
+  if get_snapshot_stamp(repos, snapshot.inputs) ~= snapshot.stamp then return false end
+
+  settings, repositories = snapshot.settings, repos
+  DEFAULT_REPOS = { Repository.url(DEFAULT_REPO_URL) }
+  -- manifests are only parsed once something asks for addons; repo list and lite-xl list never do
+  for i, repo in ipairs(repositories) do
+    repo.lite_xls = common.map(snapshot.repositories[i].lite_xls, function(metadata) return LiteXL.new(repo, metadata) end)
+    repo.remotes = common.map(snapshot.repositories[i].remotes, function(url) return Repository.url(url) end)
+    repo.snapshotted = true
+  end
+  lite_xls = common.map(snapshot.lite_xls, function(metadata) return LiteXL.new(nil, metadata) end)
+  local system_lite_xl
+  local function dereference(ref)
+    if not ref then return nil end
+    if ref.system then return system_lite_xl end
+    if ref.lite_xl then return lite_xls[ref.lite_xl] end
+    if ref.metadata then return LiteXL.new(nil, ref.metadata) end
+    return repositories[ref.repository].lite_xls[ref.index]
+  end
+  system_lite_xl = dereference(snapshot.system)
+  primary_lite_xl = dereference(snapshot.primary)
+  system_bottle = Bottle.new({ lite_xl = system_lite_xl, is_system = true })
+  if VERBOSE then log.action("Using snapshot " .. path .. ".") end
+  return true
+end
+
 function lpm.command(ARGS)
   if not ARGS[2]:find("%S") then return
   elseif ARGS[2] == "init" then return
@@ -2714,6 +3010,7 @@ function lpm.command(ARGS)
   elseif ARGS[2] == "repo" and ARGS[3] == "update" then lpm.repo_update(table.unpack(common.slice(ARGS, 4)))
   elseif ARGS[2] == "repo" and (#ARGS == 2 or ARGS[3] == "list") then return lpm.repo_list()
   elseif ARGS[2] == "apply" then return lpm.apply(table.unpack(common.slice(ARGS, 3)))
+  elseif ARGS[2] == "plan" then return lpm.plan(table.unpack(common.slice(ARGS, 3)))
   elseif (ARGS[2] == "plugin" or ARGS[2] == "color" or ARGS[2] == "library" or ARGS[2] == "font") and ARGS[3] == "install" then lpm.install(ARGS[2], table.unpack(common.slice(ARGS, 4)))
   elseif (ARGS[2] == "plugin" or ARGS[2] == "color" or ARGS[2] == "library" or ARGS[2] == "font") and ARGS[3] == "uninstall" then lpm.addon_uninstall(ARGS[2], table.unpack(common.slice(ARGS, 4)))
   elseif (ARGS[2] == "plugin" or ARGS[2] == "color" or ARGS[2] == "library" or ARGS[2] == "font") and ARGS[3] == "reinstall" then lpm.addon_reinstall(ARGS[2], table.unpack(common.slice(ARGS, 4)))
@@ -2741,6 +3038,7 @@ function lpm.command(ARGS)
   elseif ARGS[2] == "bottle" and ARGS[3] == "dump" then return lpm.bottle_dump(table.unpack(common.slice(ARGS, 4)))
   elseif ARGS[2] == "bottle" and ARGS[3] == "purge" then return lpm.bottle_purge(common.slice(ARGS, 4))
   elseif ARGS[2] == "cache" and ARGS[3] == "purge" then return lpm.cache_purge(common.slice(ARGS, 4))
+  elseif ARGS[2] == "store" and ARGS[3] == "gc" then return lpm.store_gc()
   elseif ARGS[2] == "dump" then return lpm.bottle_dump(table.unpack(common.slice(ARGS, 3)))
   elseif ARGS[2] == "run" then return lpm.lite_xl_run(table.unpack(common.slice(ARGS, 3)))
   elseif ARGS[2] == "switch" then return lpm.lite_xl_switch(table.unpack(common.slice(ARGS, 3)))
@@ -2793,7 +3091,7 @@ xpcall(function()
     ["no-install-optional"] = "flag", datadir = "string", binary = "string", trace = "flag", progress = "flag",
     symlink = "flag", reinstall = "flag", ["no-color"] = "flag", config = "string", table = "string", header = "string",
     repository = "string", ephemeral = "flag", mask = "array", raw = "string", plugin = "array", ["no-network"] = "flag",
-    ["no-git"] = "flag", update = "flag",
+    ["no-git"] = "flag", update = "flag", store = "flag",
     -- filtration flags
     author = "array", tag = "array", stub = "array", dependency = "array", status = "array",
     type = "array", name = "array"
@@ -2808,7 +3106,7 @@ Usage: lpm COMMAND [...ARGUMENTS] [--json] [--userdir=directory]
   [--cachedir=directory] [--quiet] [--version] [--help] [--remotes]
   [--ssl-certs=directory/file] [--force] [--arch=]] .. DEFAULT_ARCH .. [[]
   [--assume-yes] [--no-install-optional] [--verbose] [--mod-version=3]
-  [--datadir=directory] [--binary=path] [--symlink] [--post] [--reinstall]
+  [--datadir=directory] [--binary=path] [--symlink] [--store] [--post] [--reinstall]
   [--no-color] [--table=...] [--plugin=file/url] [--tmpdir=directory] [--configdir=directory]
 
 LPM is a package manager for `lite-xl`, written in C (and packed-in lua).
@@ -2857,6 +3155,9 @@ It has the following commands:
   lpm [plugin|library|color] list          List all/associated addons.
    <remote> [...<remote>]
 
+  lpm plan <addon id>[:<version>]          Shows what would be installed, and
+    [...<addon id>:<version>]              in which order, to apply the
+                                           specified addons.
   lpm upgrade                              Upgrades all installed addons
                                            to new version if applicable.
   lpm self-upgrade [version]               Upgrades lpm to a new version,
@@ -2888,6 +3189,8 @@ It has the following commands:
 
   lpm purge                                Completely purge all state for LPM.
   lpm bottle purge                         Purges all bottles.
+  lpm store gc                             Removes files from the addon store
+                                           that are no longer installed anywhere.
   lpm -                                    Read these commands from stdin in
                                            an interactive print-eval loop.
   lpm help                                 Displays this help text.
@@ -2930,6 +3233,10 @@ Flags have the following effects:
                            If a repository contains a file of the same name as a
                            `files` download in the primary directory, will also
                            symlink that, rather than downloading.
+  --store                  Hardlink installed addon files from a store of
+                           unique files in the cache directory, rather than
+                           copying them. Editing an installed file in place
+                           will edit it everywhere it's installed.
   --reinstall              Ignores that things may be the same, and attempts
                            to reinstall all modules.
   --no-color               Suppresses ANSI escape sequences that are emitted
@@ -3068,8 +3375,10 @@ not commonly used publically.
   CACHEDIR = common.normalize_path(ARGS["cachedir"]) or os.getenv("LPM_CACHE") or ((os.getenv("XDG_CACHE_HOME") or (HOME .. PATHSEP .. ".cache")) .. PATHSEP .. "lpm")
   CONFIGDIR = common.normalize_path(ARGS["configdir"]) or os.getenv("LPM_CONFIG") or ((os.getenv("XDG_CONFIG_HOME") or (HOME .. PATHSEP .. ".config")) .. PATHSEP .. "lpm")
   TMPDIR = common.normalize_path(ARGS["tmpdir"]) or os.getenv("LPM_TMPDIR") or (CACHEDIR .. PATHSEP .. "tmp")
+  STORE = ARGS["store"] and (CACHEDIR .. PATHSEP .. "store")
   BOTTLEDIR = common.normalize_path(ARGS["bottledir"]) or os.getenv("LPM_BOTTLEDIR") or ((os.getenv("XDG_STATE_HOME") or (HOME .. PATHSEP .. ".local" .. PATHSEP  .. "state")) .. PATHSEP .. "lpm" .. PATHSEP .. "bottles")
   if ARGS["trace"] then system.trace(true) end
+  system.hash_cache(CACHEDIR .. PATHSEP .. "hashes")
 
 
   MASK = {}
@@ -3138,9 +3447,9 @@ not commonly used publically.
       if ssl_certs == "noverify" then
         system.certs("noverify")
       else
-        local stat = system.stat(ssl_certs)
-        if not stat then error("can't find " .. ssl_certs) end
-        system.certs(stat.type, ssl_certs)
+        local type = system.type(ssl_certs)
+        if type == nil then error("can't find " .. ssl_certs) end
+        system.certs(type, ssl_certs)
       end
     else
       common.mkdirp(CACHEDIR)
@@ -3180,9 +3489,9 @@ oyi3B43njTOQ5yOf+1CceWxG1bQVs5ZufpsMljq4Ui0/1lvh+wjChP4kqKOJ2qxq
 mRGunUHBcnWEvgJBQl9nJEiU0Zsnvgc/ubhPgXRR4Xq37Z0j4r7g1SgEEzwxA57d
 emyPxgcYxn/eR44/KJ4EBs+lVDR3veyJm+kXQ99b21/+jh5Xos1AnX5iItreGCc=
 -----END CERTIFICATE-----]]
-      local stat = system.stat(cert_path)
+      local modified = system.stat(cert_path, "modified")
         -- Every 30 days, we should grab a new bundle.
-      local cert_contents = stat and stat.modified > (os.time() - 30*86400) and common.read(cert_path) or ""
+      local cert_contents = modified and modified > (os.time() - 30*86400) and common.read(cert_path) or ""
       if not ssl_certs then
         ssl_certs = cert_contents:find(lets_encrypt_root_certificate, 1, true) and "mozilla" or "system"
       end
@@ -3216,10 +3525,10 @@ emyPxgcYxn/eR44/KJ4EBs+lVDR3veyJm+kXQ99b21/+jh5Xos1AnX5iItreGCc=
         else
           local has_certs = false
           for i, path in ipairs(paths) do
-            local stat = system.stat(path)
-            if stat then
+            local type = system.type(path)
+            if type ~= nil then
               has_certs = true
-              system.certs(stat.type, path)
+              system.certs(type, path)
               break
             end
           end
@@ -3243,11 +3552,11 @@ emyPxgcYxn/eR44/KJ4EBs+lVDR3veyJm+kXQ99b21/+jh5Xos1AnX5iItreGCc=
   
   local lpm_plugins_path = HOME .. PATHSEP .. ".config" .. PATHSEP .. "lpm" .. PATHSEP .. "plugins"
   local lpm_plugins = {}
-  if system.stat(lpm_plugins_path) then
+  if system.exists(lpm_plugins_path) then
     local files = system.ls(lpm_plugins_path)
     lpm_plugins = common.concat(
       common.map(common.grep(files, function(path) return path:find("%.lua$") end), function(path) return lpm_plugins_path .. PATHSEP .. path end),
-      common.grep(common.map(common.grep(files, function(path) return not path:find("%.lua$") end), function(path) return lpm_plugins_path .. PATHSEP .. path .. PATHSEP .. "init.lua" end), function(path) return system.stat(path) end)
+      common.grep(common.map(common.grep(files, function(path) return not path:find("%.lua$") end), function(path) return lpm_plugins_path .. PATHSEP .. path .. PATHSEP .. "init.lua" end), function(path) return system.exists(path) end)
     )
   end
   local env = setmetatable({}, { __index = _G, __newindex = function(t, k, v) _G[k] = v end })
@@ -3280,7 +3589,7 @@ emyPxgcYxn/eR44/KJ4EBs+lVDR3veyJm+kXQ99b21/+jh5Xos1AnX5iItreGCc=
     arg[0] = ARGS[1]
     rawset(_G, "arg", arg)
     local chunk, err
-    if system.stat(ARGS[3]) then
+    if system.exists(ARGS[3]) then
       chunk, err = load(common.read(ARGS[3]), ARGS[3], "bt", env)
     else
       chunk, err = load(ARGS[3], "", "bt", env)
@@ -3345,12 +3654,21 @@ emyPxgcYxn/eR44/KJ4EBs+lVDR3veyJm+kXQ99b21/+jh5Xos1AnX5iItreGCc=
     os.exit(0)
   end
 
-  if not system.stat(USERDIR) then common.mkdirp(USERDIR) end
-  if not system.stat(CACHEDIR) then common.mkdirp(CACHEDIR) end
-  if not system.stat(CONFIGDIR) then common.mkdirp(CONFIGDIR) end
+  if not system.exists(USERDIR) then common.mkdirp(USERDIR) end
+  if not system.exists(CACHEDIR) then common.mkdirp(CACHEDIR) end
+  if not system.exists(CONFIGDIR) then common.mkdirp(CONFIGDIR) end
+  if STORE and not system.exists(STORE) then common.mkdirp(STORE) end
+  STAGING = {}
+  for i, root in ipairs({ USERDIR, BOTTLEDIR, CACHEDIR }) do STAGING[root] = common.staging_dir(root) end
   
   if engage_locks(function()
-    lpm.setup()
+    if not is_read_only(ARGS) or not lpm.load_snapshot() then
+      lpm.setup()
+      if is_read_only(ARGS) then
+        local status, err = pcall(lpm.save_snapshot)
+        if not status and VERBOSE then log.warning("can't write snapshot: " .. err) end
+      end
+    end
   end, error_handler, lock_warning) then return end
 
   if ARGS[2] ~= '-' then
@@ -0,0 +1,38 @@
+-- Compares the native JSON decoder and encoder against the lua ones they replaced (rxi's, which still ship as
+-- libraries/json.lua), on a pretty-printed manifest built by repeating the addons in manifest.json.
+-- Run from the root of the repository with: lpm exec t/bench_json.lua [addon count]
+local rxi = load(common.read("libraries/json.lua"))()
+local manifest = json.decode(common.read("manifest.json"))
+local count = tonumber(arg[1]) or 1600
+local addons = {}
+for i = 1, count do
+  local addon = common.merge({}, manifest.addons[(i - 1) % #manifest.addons + 1])
+  addon.id = addon.id .. i
+  table.insert(addons, addon)
+end
+local text = json.encode({ addons = addons }, { pretty = true })
+
+local function best_of(runs, func)
+  local best = math.huge
+  for i = 1, runs do
+    local start = system.time()
+    func()
+    best = math.min(best, system.time() - start)
+  end
+  return best * 1000
+end
+
+local function same(a, b)
+  if type(a) ~= type(b) then return false end
+  if type(a) ~= "table" then return a == b and math.type(a) == math.type(b) end
+  for k, v in pairs(a) do if not same(v, b[k]) then return false end end
+  for k in pairs(b) do if a[k] == nil then return false end end
+  return true
+end
+
+print(string.format("%d addons, %d bytes", count, #text))
+assert(same(rxi.decode(text), json.decode(text)), "decoders disagree")
+print(string.format("decode: lua %.1fms, native %.1fms", best_of(3, function() rxi.decode(text) end), best_of(10, function() json.decode(text) end)))
+local value = json.decode(text)
+assert(#rxi.encode(value) == #json.encode(value), "encoders disagree")
+print(string.format("encode: lua %.1fms, native %.1fms", best_of(3, function() rxi.encode(value) end), best_of(10, function() json.encode(value) end)))
@@ -126,12 +126,361 @@ local tests = {
   end,
   ["13_repos"] = function()
     lpm("repo add https://github.com/jgmdev/lite-xl-threads.git")
+  end,
+  ["14_extract_pax"] = function()
+    -- Long names and links only fit in PAX records; out of range mtimes should be clamped, not rejected.
+    local src, dst = tmpdir .. "/pax", tmpdir .. "/paxout"
+    local name = string.rep("a", 80) .. "/" .. string.rep("b", 80) .. "=c.lua"
+    os.execute(string.format("mkdir -p %s/%s && printf test > %s/%s && touch -d @5000000000 %s/%s && ln -s %s %s/%s && touch -h -d @-100 %s/%s",
+      src, common.dirname(name), src, name, src, name, name, src, string.rep("l", 120), src, string.rep("l", 120)))
+    assert(os.execute(string.format("tar --format=pax -C %s -czf %s.tar.gz .", src, src)))
+    system.extract(src .. ".tar.gz", dst)
+    assert(io.open(dst .. "/" .. name, "rb"):read("*all") == "test")
+    assert(system.stat(dst .. "/" .. string.rep("l", 120)).symlink == name)
+    -- An extended header bigger than any real one is refused, rather than read into memory.
+    local function header(name, size, type)
+      local fields = name .. string.rep("\0", 100 - #name) .. "0000644\0" .. "0000000\0" .. "0000000\0" .. string.format("%011o\0", size) .. "00000000000\0" .. "        " .. type
+      local block = fields .. string.rep("\0", 512 - #fields)
+      local sum = 0
+      for i = 1, #block do sum = sum + block:byte(i) end
+      return block:sub(1, 148) .. string.format("%06o\0 ", sum) .. block:sub(157)
+    end
+    local size = 2 * 1024 * 1024
+    io.open(src .. ".tar", "wb"):write(header("pax", size, "x") .. string.rep("\0", size) .. header("file", 0, "0") .. string.rep("\0", 1024)):close()
+    local status, err = pcall(system.extract, src .. ".tar", dst)
+    assert(not status and err:find("too large"))
+  end,
+  ["15_store_edited_blob"] = function()
+    -- Editing an installed file in place edits its blob too; the next install shouldn't link to that.
+    local store = tmpdir .. "/store"
+    system.mkdirp(store)
+    io.open(tmpdir .. "/src", "wb"):write("original"):close()
+    system.store(tmpdir .. "/src", tmpdir .. "/dst1", store)
+    io.open(tmpdir .. "/dst1", "r+b"):write("modified"):close()
+    system.store(tmpdir .. "/src", tmpdir .. "/dst2", store)
+    assert(io.open(tmpdir .. "/dst2", "rb"):read("*all") == "original")
+  end,
+  ["16_tree_stamp"] = function()
+    -- Installed state is only reused while this is the same, so edits anywhere in an addon have to change it.
+    local root = tmpdir .. "/stamp"
+    system.mkdirp(root .. "/plugin/deep/er")
+    io.open(root .. "/plugin/deep/er/init.lua", "wb"):write("a"):close()
+    local stamp = system.tree_stamp(root)
+    assert(stamp and stamp == system.tree_stamp(root))
+    assert(system.tree_stamp(tmpdir .. "/nothing") == nil)
+    os.execute("touch -d @1000000000 " .. root .. "/plugin/deep/er/init.lua")
+    assert(system.tree_stamp(root) ~= stamp)
+    -- So do new commits in any checkout, including those of stubs' remotes that aren't configured repositories.
+    local checkout = tmpdir .. "/repos/" .. system.hash("https://example.com/stub") .. "/master"
+    system.mkdirp(checkout .. "/.git")
+    local script = tmpdir .. "/state.lua"
+    io.open(script, "wb"):write(string.format([[
+      repositories = {}
+      system_bottle = Bottle.new({ lite_xl = LiteXL.new(nil, { mod_version = "3", datadir_path = %q, version = "system", tags = {} }), is_system = true })
+      print(json.encode({ stamp = system_bottle:get_state_stamp() }))
+    ]], tmpdir .. "/data")):close()
+    io.open(checkout .. "/.git/HEAD", "wb"):write(string.rep("a", 40) .. "\n"):close()
+    local before = lpm("exec " .. script).stamp
+    io.open(checkout .. "/.git/HEAD", "wb"):write(string.rep("b", 40) .. "\n"):close()
+    assert(before and lpm("exec " .. script).stamp ~= before)
+  end,
+  ["17_json_decode"] = function()
+    -- Should decode exactly as the lua decoder in libraries/json.lua does, errors included.
+    local reference = load(io.open("libraries/json.lua", "rb"):read("*all"))()
+    local function same(a, b)
+      if type(a) ~= type(b) then return false end
+      if type(a) ~= "table" then return a == b and math.type(a) == math.type(b) end
+      for k, v in pairs(a) do if not same(v, b[k]) then return false end end
+      for k in pairs(b) do if a[k] == nil then return false end end
+      return true
+    end
+    for _, text in ipairs({
+      '{"a":[1,2.5,-3e2,1.0,1E2,0.5e-1,12345678901234567890,null,true,false],"b":{},"c":[],"d":null}',
+      ' [ 1 , [ [ ] ] , {"k" : "v"} ] ', '"plain"', '12', '0x10', '{"a":1,"a":2}', '"\\u00e9\\ud83d\\ude00\\/\\b\\f\\n\\r\\t\\"\\\\"',
+      '"' .. string.rep("abcdefgh", 10) .. '\\"' .. string.rep("z", 40) .. '"',
+      '[1,2', '[1,2 ', '{"a" 1}', '[1 2]', 'tru', '"abc', '"a\tb"', '[1]x', '', '{1:2}', '"\\q"', '"\\u12"', '-', '{\n"a":\n[1,\n}'
+    }) do
+      local reference_status, reference_result = pcall(reference.decode, text)
+      local status, result = pcall(json.decode, text)
+      assert(status == reference_status, text)
+      if status then
+        assert(same(result, reference_result), text)
+      else
+        assert(reference_result:find(result, 1, true), text .. ": " .. result .. " vs. " .. reference_result)
+      end
+    end
+    -- Surrogates only combine into one codepoint when a high one is followed by a low one.
+    assert(json.decode('"\\ud83d\\ude00"') == "\xF0\x9F\x98\x80")
+    assert(json.decode('"\\ud800\\u0041"') == "\xED\xA0\x80A")
+    assert(json.decode('"\\ud800"') == "\xED\xA0\x80")
+  end,
+  ["18_json_encode"] = function()
+    -- Numbers are formatted with %.14g, and pretty output sorts keys, as the lua encoder did.
+    assert(json.encode({ 1, 2.5, -300, 1e20, 0.1 + 0.2, 2^53, math.maxinteger, 1/3 }) == "[1,2.5,-300,1e+20,0.3,9.007199254741e+15,9.2233720368548e+18,0.33333333333333]")
+    assert(json.encode("x\n\1\127é/\"\\\t") == '"x\\n\\u0001\127é/\\"\\\\\\t"')
+    assert(json.encode({ b = { 1, {} }, a = "s", c = { d = true, e = false } }, { pretty = true }) == '{\n  "a": "s",\n  "b": [\n    1,\n    {}\n  ],\n  "c": {\n    "d": true,\n    "e": false\n  }\n}')
+    assert(json.encode({ b = 1, a = { 2 } }, { pretty = true, indent = "\t" }) == '{\n\t"a": [\n\t\t2\n\t],\n\t"b": 1\n}')
+    for _, value in ipairs({ { 1, 2, nil, 4 }, { 1, x = 2 }, { [1.5] = 1 }, { x = print }, { 0/0 }, { math.huge } }) do
+      assert(not pcall(json.encode, value))
+    end
+    -- Streaming into a file gives the same output, and write_json leaves the previous file alone if encoding fails.
+    local path, value = tmpdir .. "/out.json", {}
+    for i = 1, 10000 do table.insert(value, { id = "addon" .. i, version = "1.0" }) end
+    common.write_json(path, value, { pretty = true })
+    assert(io.open(path, "rb"):read("*all") == json.encode(value, { pretty = true }))
+    assert(not pcall(common.write_json, path, { value, print }))
+    assert(io.open(path, "rb"):read("*all") == json.encode(value, { pretty = true }))
+    assert_not_exists(path .. ".part")
+    -- A symlink to the file stays a symlink, with the file it points to replaced.
+    system.mkdirp(tmpdir .. "/dotfiles")
+    system.symlink("../out.json", tmpdir .. "/dotfiles/settings.json")
+    common.write_json(tmpdir .. "/dotfiles/settings.json", { linked = true })
+    assert(system.stat(tmpdir .. "/dotfiles/settings.json").symlink == "../out.json")
+    assert(io.open(path, "rb"):read("*all") == json.encode({ linked = true }))
+  end,
+  ["19_manifest_index"] = function()
+    -- A manifest read back from the index should give the same addons as one parsed from scratch.
+    local repo = tmpdir .. "/repo/master"
+    system.mkdirp(repo .. "/.git")
+    system.mkdirp(repo .. "/plugins/complex")
+    io.open(repo .. "/.git/HEAD", "wb"):write(string.rep("a", 40) .. "\n"):close()
+    io.open(repo .. "/plugins/single.lua", "wb"):write("-- mod-version:3"):close()
+    io.open(repo .. "/plugins/complex/init.lua", "wb"):write("-- mod-version:3"):close()
+    io.open(repo .. "/manifest.json", "wb"):write([[{ "addons": [
+      { "id": "single", "version": 1.0, "mod_version": 3, "path": "plugins/single.lua" },
+      { "id": "complex", "version": "0.2", "mod_version": 3, "path": "plugins/complex", "dependencies": { "single": {} } },
+      { "id": "stub", "version": "1.0", "remote": "https://example.com/stub:master" }
+    ] }]]):close()
+    local script = tmpdir .. "/index.lua"
+    io.open(script, "wb"):write(string.format([[
+      local function load()
+        local repo = Repository.new({ remote = "https://example.com/repo", branch = "master", repo_path = %q })
+        repo:parse_manifest()
+        return repo
+      end
+      local function fields(addon) return { id = addon.id, version = addon.version, organization = addon.organization, path = addon.path, local_path = addon.local_path, dependencies = addon.dependencies, remote = addon.remote } end
+      local cold = load()
+      local cold_addons = common.map(cold:get_addons(), fields)
+      -- Looking ids up in the index shouldn't need the manifest at all.
+      os.rename(%q, %q)
+      local warm = load()
+      local found = common.flat_map({ "single", "complex", "stub", "missing" }, function(id) return warm:get_addons(id) end)
+      local decoded = warm.entries ~= nil
+      os.rename(%q, %q)
+      local all = warm:get_addons()
+      print(json.encode({ indexed = warm.indexed, decoded = decoded, same_objects = all[1] == found[1] and all[3] == found[3], cold = cold_addons, warm = common.map(found, fields) }))
+    ]], tmpdir .. "/repo", repo .. "/manifest.json", repo .. "/manifest.bak", repo .. "/manifest.bak", repo .. "/manifest.json")):close()
+    local result = lpm("exec " .. script)
+    assert(result.indexed and not result.decoded and result.same_objects)
+    assert(json.encode(result.cold) == json.encode(result.warm))
+    assert(result.warm[1].version == "1.0" and result.warm[1].organization == "singleton")
+    assert(result.warm[2].organization == "complex" and result.warm[2].dependencies.single)
+    -- Ids from the index are checked like those from a manifest.
+    local path = result.indexed .. "/" .. system.hash("single") .. ".json"
+    local record = json.decode(io.open(path, "rb"):read("*all"))
+    record.addons[1].id = "Not valid"
+    io.open(path, "wb"):write(json.encode(record)):close()
+    assert(not pcall(lpm, "exec " .. script))
+  end,
+  ["20_resolve"] = function()
+    local repo = tmpdir .. "/resolve/master"
+    system.mkdirp(repo .. "/.git")
+    io.open(repo .. "/.git/HEAD", "wb"):write(string.rep("a", 40) .. "\n"):close()
+    local addons = {
+      { id = "a", version = "1.0", dependencies = { b = { version = ">=1.0" } } },
+      { id = "b", version = "1.0" },
+      { id = "b", version = "2.0" },
+      { id = "c", version = "1.0", dependencies = { b = { version = "<=1.5" } } },
+      { id = "d", version = "1.0", conflicts = { a = {} } },
+      { id = "e", version = "1.0", dependencies = { f = {} } },
+      { id = "f", version = "1.0", dependencies = { e = {} } },
+      { id = "g", version = "1.0", dependencies = { missing = {} } },
+      { id = "h", version = "1.0", provides = { "lsp" } },
+      { id = "i", version = "1.0", dependencies = { lsp = {}, opt = { optional = true } } },
+      { id = "opt", version = "1.0" },
+      { id = "u", version = "1.0", dependencies = { b = { version = ">=2.0" } } },
+      { id = "z", version = "1.0", dependencies = { p = {}, q = {} } },
+      { id = "p", version = "1.0", conflicts = { q = {} } },
+      { id = "q", version = "1.0" },
+      -- Once m:1.0 is installed, it's in the way of n, r and s; o needs it upgraded anyway, and r only minds m:1.0.
+      { id = "m", version = "1.0", conflicts = { n = {} } },
+      { id = "m", version = "2.0" },
+      { id = "n", version = "1.0", dependencies = { o = {} } },
+      { id = "o", version = "1.0", dependencies = { m = { version = ">=2.0" } } },
+      { id = "r", version = "1.0", conflicts = { m = { version = "<=1.5" } } },
+      { id = "s", version = "1.0", conflicts = { m = {} } }
+    }
+    -- Plenty of unrelated choices ahead of z, which can never be met; without backjumping, each combination gets tried.
+    for i = 1, 20 do
+      table.insert(addons, { id = "x" .. i, version = "1.0" })
+      table.insert(addons, { id = "x" .. i, version = "2.0" })
+    end
+    for _, addon in ipairs(addons) do
+      addon.mod_version, addon.path = "3", addon.id .. addon.version .. ".lua"
+      io.open(repo .. "/" .. addon.path, "wb"):write("-- mod-version:3\n-- " .. addon.path):close()
+    end
+    io.open(repo .. "/manifest.json", "wb"):write(json.encode({ addons = addons })):close()
+    local script = tmpdir .. "/resolve.lua"
+    io.open(script, "wb"):write(string.format([[
+      local repo = Repository.new({ remote = "https://example.com/repo", branch = "master", repo_path = %q })
+      repo:parse_manifest()
+      repositories, settings = { repo }, { installed = {} }
+      STAGING = {} for _, root in ipairs({ USERDIR, CACHEDIR }) do STAGING[root] = common.staging_dir(root) end
+      system_bottle = Bottle.new({ lite_xl = LiteXL.new(nil, { mod_version = "3", datadir_path = %q, version = "system", tags = {} }), is_system = true })
+      local function requests(...) return common.map({ ... }, function(id) return { system_bottle:get_addon(id, nil, { mod_version = "3" }) } end) end
+      local function plan(...)
+        local addons, err = system_bottle:resolve(requests(...))
+        return addons and common.map(addons, function(addon) return addon.id .. ":" .. addon.version end) or err
+      end
+      -- Resolving one addon only builds the addons it involves, rather than the whole catalogue.
+      local results = { a = plan("a") }
+      local materialized = 0
+      for _ in pairs(repo.materialized) do materialized = materialized + 1 end
+      results.materialized, results.catalogue = materialized, system_bottle.all_addons_cache ~= nil
+      results.ac, results.ad, results.e, results.g, results.i = plan("a", "c"), plan("a", "d"), plan("e"), plan("g"), plan("i")
+      local xs = {}
+      for i = 1, 20 do table.insert(xs, "x" .. i) end
+      local start = system.time()
+      results.xz = plan(table.unpack(common.concat(xs, { "z" })))
+      results.xz_time = system.time() - start
+      system_bottle:get_addon("b", "1.0"):install(system_bottle)
+      results.installed = plan("a")
+      results.upgrade = plan("u")
+      system_bottle:apply(requests("b", "u"))
+      results.applied = common.map(common.grep(system_bottle:installed_addons(), function(addon) return addon.id == "b" or addon.id == "u" end), function(addon) return addon.id .. ":" .. addon.version end)
+      system_bottle:get_addon("m", "1.0"):install(system_bottle)
+      results.n, results.on, results.r, results.s = plan("n"), plan("o", "n"), plan("r"), plan("s")
+      print(json.encode(results))
+    ]], tmpdir .. "/resolve", tmpdir .. "/data")):close()
+    local result = lpm("exec " .. script)
+    assert(table.concat(result.a, " ") == "b:2.0 a:1.0")
+    assert(result.materialized == 3 and not result.catalogue)
+    assert(table.concat(result.ac, " ") == "b:1.0 a:1.0 c:1.0")
+    assert(result.ad == "d:1.0 conflicts with a:1.0")
+    assert(result.e:find("circular dependency"))
+    assert(result.g:find("can't find dependency missing"))
+    assert(table.concat(result.i, " ") == "h:1.0 i:1.0")
+    assert(result.xz == "p:1.0 conflicts with q:1.0" and result.xz_time < 1)
+    -- Installed addons are kept when they'll do, and upgraded when they won't.
+    assert(table.concat(result.installed, " ") == "a:1.0")
+    assert(table.concat(result.upgrade, " ") == "b:2.0 u:1.0")
+    table.sort(result.applied)
+    assert(table.concat(result.applied, " ") == "b:2.0 u:1.0")
+    -- Installed addons in the way of something are upgraded out of it, if they can be.
+    assert(table.concat(result.n, " ") == "m:2.0 o:1.0 n:1.0")
+    assert(table.concat(result.on, " ") == "m:2.0 o:1.0 n:1.0")
+    assert(table.concat(result.r, " ") == "r:1.0 m:2.0")
+    assert(result.s == "s:1.0 conflicts with m:2.0")
+  end,
+  ["21_snapshot"] = function()
+    -- A snapshot of lpm's setup has to be thrown away when a different lite-xl turns up on the PATH.
+    io.open(tmpdir .. "/settings.json", "wb"):write(json.encode({ repositories = {}, installed = {}, lite_xls = {} })):close()
+    for _, name in ipairs({ "first", "second" }) do
+      system.mkdirp(tmpdir .. "/" .. name .. "/data/core")
+      io.open(tmpdir .. "/" .. name .. "/data/core/start.lua", "wb"):write("MOD_VERSION_MAJOR = 3"):close()
+      io.open(tmpdir .. "/" .. name .. "/lite-xl", "wb"):write("#!/bin/sh\n"):close()
+      system.chmod(tmpdir .. "/" .. name .. "/lite-xl", 493)
+    end
+    system.mkdirp(tmpdir .. "/link")
+    local function system_binary(path)
+      local result = lpm("lite-xl list", "PATH=" .. path .. ":" .. os.getenv("PATH"))
+      local lite_xl = common.first(result["lite-xls"], function(lite_xl) return common.first(lite_xl.tags, function(tag) return tag == "system" end) end)
+      return lite_xl and lite_xl.binary_path[next(lite_xl.binary_path)]
+    end
+    assert(system_binary(tmpdir .. "/first") == tmpdir .. "/first/lite-xl")
+    assert(system_binary(tmpdir .. "/second") == tmpdir .. "/second/lite-xl")
+    assert(system_binary(tmpdir .. "/link") == nil)
+    system.symlink(tmpdir .. "/first/lite-xl", tmpdir .. "/link/lite-xl")
+    assert(system_binary(tmpdir .. "/link") == tmpdir .. "/first/lite-xl")
+    os.remove(tmpdir .. "/link/lite-xl")
+    system.symlink(tmpdir .. "/second/lite-xl", tmpdir .. "/link/lite-xl")
+    assert(system_binary(tmpdir .. "/link") == tmpdir .. "/second/lite-xl")
+    -- Or when settings.json changes, even if its size and modification time don't.
+    local function settings(primary)
+      local lite_xls = {}
+      for _, version in ipairs({ "1.0", "2.0" }) do
+        table.insert(lite_xls, string.format('{ "version": "%s", "mod_version": "3", "primary": %s }', version, version == primary and "true " or "false"))
+      end
+      io.open(tmpdir .. "/settings.json", "wb"):write('{ "repositories": [], "installed": {}, "lite_xls": [' .. table.concat(lite_xls, ", ") .. '] }'):close()
+      os.execute("touch -d @1000000000 " .. tmpdir .. "/settings.json")
+    end
+    local function primary()
+      local result = lpm("lite-xl list", "PATH=" .. tmpdir .. "/first:" .. os.getenv("PATH"))
+      local lite_xl = common.first(result["lite-xls"], function(lite_xl) return common.first(lite_xl.tags, function(tag) return tag == "primary" end) end)
+      return lite_xl and lite_xl.version
+    end
+    settings("1.0")
+    assert(primary() == "1.0")
+    settings("2.0")
+    assert(primary() == "2.0")
+  end,
+  ["22_symlink_across_devices"] = function()
+    -- A symlink staged next to the userdir is moved into place as a symlink, even when it points to another device,
+    -- as repositories in a separate cachedir do.
+    local cache = "/dev/shm/lpmtest-cache"
+    if not system.exists("/dev/shm") or system.stat("/dev/shm", "device") == system.stat(tmpdir, "device") then return end
+    local repo = cache .. "/symlink/master"
+    common.rmrf(cache)
+    system.mkdirp(repo .. "/.git")
+    io.open(repo .. "/.git/HEAD", "wb"):write(string.rep("a", 40) .. "\n"):close()
+    io.open(repo .. "/single.lua", "wb"):write("-- mod-version:3"):close()
+    io.open(repo .. "/manifest.json", "wb"):write(json.encode({ addons = { { id = "single", version = "1.0", mod_version = "3", path = "single.lua" } } })):close()
+    local script = tmpdir .. "/symlink.lua"
+    io.open(script, "wb"):write(string.format([[
+      local repo = Repository.new({ remote = "https://example.com/symlink", branch = "master", repo_path = %q })
+      repo:parse_manifest()
+      repositories, settings, SYMLINK, TMPDIR = { repo }, { installed = {} }, true, %q
+      common.mkdirp(TMPDIR)
+      STAGING = {} for _, root in ipairs({ USERDIR, BOTTLEDIR, CACHEDIR }) do STAGING[root] = common.staging_dir(root) end
+      system_bottle = Bottle.new({ lite_xl = LiteXL.new(nil, { mod_version = "3", datadir_path = %q, version = "system", tags = {} }), is_system = true })
+      local addon = system_bottle:get_addon("single")
+      addon:install(system_bottle)
+      print(json.encode({ path = addon:get_install_path(system_bottle) }))
+    ]], cache .. "/symlink", tmpdir .. "/staging", tmpdir .. "/data")):close()
+    local result = lpm("exec " .. script)
+    common.rmrf(cache)
+    assert(system.stat(result.path).symlink == repo .. "/single.lua")
+  end,
+  ["23_unstub_all"] = function()
+    -- Stubs sharing a remote share one fetch, and take on what the remote says about them; those whose remotes can't be
+    -- fetched are marked inaccessible, rather than stopping the rest.
+    local remote = tmpdir .. "/repos/" .. system.hash("https://example.com/remote") .. "/master"
+    local stubs = tmpdir .. "/stubs/master"
+    for _, path in ipairs({ remote, stubs }) do
+      system.mkdirp(path .. "/.git")
+      io.open(path .. "/.git/HEAD", "wb"):write(string.rep("a", 40) .. "\n"):close()
+    end
+    io.open(remote .. "/one.lua", "wb"):write("-- mod-version:3"):close()
+    io.open(remote .. "/two.lua", "wb"):write("-- mod-version:3"):close()
+    io.open(remote .. "/manifest.json", "wb"):write(json.encode({ addons = {
+      { id = "one", version = "2.0", mod_version = "3", path = "one.lua" },
+      { id = "two", version = "1.0", mod_version = "3", path = "two.lua" }
+    } })):close()
+    io.open(stubs .. "/manifest.json", "wb"):write(json.encode({ addons = {
+      { id = "one", version = "1.0", mod_version = "3", remote = "https://example.com/remote:master" },
+      { id = "two", version = "1.0", mod_version = "3", remote = "https://example.com/remote:master" },
+      { id = "three", version = "1.0", mod_version = "3", remote = "file://" .. tmpdir .. "/nowhere:master" }
+    } })):close()
+    local script = tmpdir .. "/unstub.lua"
+    io.open(script, "wb"):write(string.format([[
+      local repo = Repository.new({ remote = "https://example.com/stubs", branch = "master", repo_path = %q })
+      local one, two, three = table.unpack(repo:get_addons())
+      local fetched, fetch_if_not_present = {}, Repository.fetch_if_not_present
+      Repository.fetch_if_not_present = function(self) fetched[self] = true return fetch_if_not_present(self) end
+      Addon.unstub_all({ one, two, three })
+      local fetches = 0 for _ in pairs(fetched) do fetches = fetches + 1 end
+      print(json.encode({ version = one.version, local_path = one.local_path, fetches = fetches, shared = one.repository == two.repository, inaccessible = three.inaccessible and true or false, three = three.local_path or false }))
+    ]], tmpdir .. "/stubs")):close()
+    local result = lpm("exec " .. script)
+    assert(result.version == "2.0" and result.local_path == remote .. "/one.lua")
+    assert(result.shared and result.fetches == 2)
+    assert(result.inaccessible and not result.three)
   end
 }
 
 local last_command_result, last_command
-lpm = function(cmd)
-  last_command = string.format("%s --quiet --json --assume-yes --mod-version=3 --userdir=%s --tmpdir=%s --cachedir=%s --configdir=%s %s", arg[0], userdir, tmpdir, tmpdir, tmpdir, cmd);
+lpm = function(cmd, env)
+  last_command = string.format("%s%s --quiet --json --assume-yes --mod-version=3 --userdir=%s --tmpdir=%s --cachedir=%s --configdir=%s %s", env and (env .. " ") or "", arg[0], userdir, tmpdir, tmpdir, tmpdir, cmd);
   local pipe = io.popen(last_command, "r")
   local result = pipe:read("*all")
   last_command_result = result ~= "" and json.decode(result) or nil